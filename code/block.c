@@ -7,20 +7,322 @@
  *
  */
 
+#define _GNU_SOURCE	// for O_DIRECT
+
+#include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
 #include <unistd.h>
+#include <linux/falloc.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
+
+#if defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#undef BLOCK_SIZE	// <linux/fs.h> has its own (1KB) BLOCK_SIZE, ours is in block.h
+#define BIO_HAVE_URING 1
+#endif
+#endif
 
 #include "block.h"
 
-//Disk size set to 32MB
+//Default disk size set to 32MB
 #define DISK_SIZE	32*1024*1024
 
 int diskfile = -1;
+static int backend = BIO_BACKEND_PREAD;
+static char *disk_map = NULL;	// whole disk file, when using the mmap backend
+static int direct_io = 0;	// disk file opened with O_DIRECT, so buffers must be aligned
+static off_t disk_size = 0;	// size the disk file should have (0: DISK_SIZE for a new disk, as is otherwise)
+static int can_punch = 1;	// cleared once the host file system turns down hole punching
+
+#ifndef IOV_MAX
+#define IOV_MAX 1024	// Linux's limit on iovecs per call, when limits.h doesn't say
+#endif
+
+// A run of requests for consecutive blocks in the same direction, done as one vectored I/O
+struct bio_run {
+  int first;	// index of the run's first request
+  int count;	// number of requests (blocks) in the run
+  int result;	// bytes transferred for the whole run, or < 0 on error
+};
+
+#ifdef BIO_HAVE_URING
+/*
+ * io_uring engine used by bio_submit(). The rings are set up when the disk
+ * is opened; if the kernel refuses (too old, or io_uring disabled), ring_fd
+ * stays -1 and bio_submit() falls back to one preadv/pwritev per run.
+ */
+#define URING_ENTRIES 64
+
+static int ring_fd = -1;
+static pthread_mutex_t ring_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void *sq_ring_ptr = NULL, *cq_ring_ptr = NULL;
+static size_t sq_ring_size = 0, cq_ring_size = 0;
+static struct io_uring_sqe *sqes = NULL;
+static size_t sqes_size = 0;
+
+static unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+static unsigned *cq_head, *cq_tail, *cq_mask;
+static struct io_uring_cqe *cqes;
+static unsigned sq_entries;
+
+static void uring_exit() {
+  if (sqes != NULL) munmap(sqes, sqes_size);
+  if (cq_ring_ptr != NULL && cq_ring_ptr != sq_ring_ptr) munmap(cq_ring_ptr, cq_ring_size);
+  if (sq_ring_ptr != NULL) munmap(sq_ring_ptr, sq_ring_size);
+  if (ring_fd >= 0) close(ring_fd);
+  sqes = NULL;
+  sq_ring_ptr = cq_ring_ptr = NULL;
+  ring_fd = -1;
+}
+
+static void uring_init() {
+  struct io_uring_params p;
+
+  if (ring_fd >= 0) {
+    return;
+  }
+
+  memset(&p, 0, sizeof(p));
+  ring_fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &p);
+  if (ring_fd < 0) {
+    ring_fd = -1;
+    return;
+  }
+
+  sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  if (p.features & IORING_FEAT_SINGLE_MMAP) {
+    if (cq_ring_size > sq_ring_size) sq_ring_size = cq_ring_size;
+    cq_ring_size = sq_ring_size;
+  }
+
+  sq_ring_ptr = mmap(NULL, sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                     ring_fd, IORING_OFF_SQ_RING);
+  if (sq_ring_ptr == MAP_FAILED) {
+    sq_ring_ptr = NULL;
+    uring_exit();
+    return;
+  }
+
+  if (p.features & IORING_FEAT_SINGLE_MMAP) {
+    cq_ring_ptr = sq_ring_ptr;
+  } else {
+    cq_ring_ptr = mmap(NULL, cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                       ring_fd, IORING_OFF_CQ_RING);
+    if (cq_ring_ptr == MAP_FAILED) {
+      cq_ring_ptr = NULL;
+      uring_exit();
+      return;
+    }
+  }
+
+  sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+  sqes = mmap(NULL, sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+              ring_fd, IORING_OFF_SQES);
+  if (sqes == MAP_FAILED) {
+    sqes = NULL;
+    uring_exit();
+    return;
+  }
+
+  sq_head = (unsigned *)((char *)sq_ring_ptr + p.sq_off.head);
+  sq_tail = (unsigned *)((char *)sq_ring_ptr + p.sq_off.tail);
+  sq_mask = (unsigned *)((char *)sq_ring_ptr + p.sq_off.ring_mask);
+  sq_array = (unsigned *)((char *)sq_ring_ptr + p.sq_off.array);
+  cq_head = (unsigned *)((char *)cq_ring_ptr + p.cq_off.head);
+  cq_tail = (unsigned *)((char *)cq_ring_ptr + p.cq_off.tail);
+  cq_mask = (unsigned *)((char *)cq_ring_ptr + p.cq_off.ring_mask);
+  cqes = (struct io_uring_cqe *)((char *)cq_ring_ptr + p.cq_off.cqes);
+  sq_entries = p.sq_entries;
+}
+
+/*
+ * Queue up to sq_entries runs, enter the kernel to submit them and wait
+ * for all of them, then reap the completions into runs[].result.
+ * Returns the number of runs handled (the first ones; any the kernel
+ * wouldn't take are taken back out of the ring), or -1 if none were.
+ */
+static int uring_submit(struct bio_req *reqs, struct iovec *iovs, struct bio_run *runs, int nr) {
+  if (nr > (int)sq_entries) {
+    nr = sq_entries;
+  }
+
+  unsigned tail = *sq_tail;
+  for (int i = 0; i < nr; i++) {
+    unsigned idx = tail & *sq_mask;
+    struct io_uring_sqe *sqe = &sqes[idx];
+    struct bio_req *first = &reqs[runs[i].first];
+
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = first->write ? IORING_OP_WRITEV : IORING_OP_READV;
+    sqe->fd = diskfile;
+    sqe->off = (unsigned long long)first->block_num * BLOCK_SIZE;
+    sqe->addr = (unsigned long)&iovs[runs[i].first];
+    sqe->len = runs[i].count;
+    sqe->user_data = i;
+
+    sq_array[idx] = idx;
+    tail++;
+  }
+  __atomic_store_n(sq_tail, tail, __ATOMIC_RELEASE);
+
+  // the kernel may take fewer than it is given: enter again for the rest, which are
+  // still queued (it takes them in order, and only waits once it has taken them all)
+  int submitted = 0;
+  while (submitted < nr) {
+    int ret = syscall(__NR_io_uring_enter, ring_fd, nr - submitted, nr - submitted, IORING_ENTER_GETEVENTS, NULL, 0);
+    if (ret < 0 && errno == EINTR) {
+      continue;
+    }
+    if (ret <= 0) {
+      if (ret < 0) {
+        perror("block_submit failed");
+      }
+      break;
+    }
+    submitted += ret;
+  }
+  if (submitted < nr) {
+    // the runs it didn't take leave the ring, so they can't go in again later
+    __atomic_store_n(sq_tail, __atomic_load_n(sq_head, __ATOMIC_ACQUIRE), __ATOMIC_RELEASE);
+  }
+  if (submitted == 0) {
+    return -1;
+  }
+
+  // all the runs were waited for, so their completions are in the ring
+  int reaped = 0;
+  while (reaped < submitted) {
+    unsigned head = *cq_head;
+    unsigned ctail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+    if (head == ctail) {
+      // completions can trail the submission count if the kernel was interrupted
+      if (syscall(__NR_io_uring_enter, ring_fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0) < 0 && errno != EINTR) {
+        break;
+      }
+      continue;
+    }
+    while (head != ctail) {
+      struct io_uring_cqe *cqe = &cqes[head & *cq_mask];
+      runs[cqe->user_data].result = cqe->res;
+      head++;
+      reaped++;
+    }
+    __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+  }
+
+  return submitted;
+}
+#endif
+
+//Select how blocks are read and written; takes effect on the next dev_init/dev_open
+void dev_set_backend(int which) {
+  backend = which;
+}
+
+/*
+ * Open the disk file with O_DIRECT, so its blocks skip the host page cache and
+ * only live in rufs's own block cache. O_DIRECT transfers need BLOCK_SIZE
+ * aligned buffers; get them from bio_alloc(). Unaligned buffers still work,
+ * but go through a bounce buffer. Takes effect on the next dev_init/dev_open.
+ */
+void dev_set_direct(int on) {
+  direct_io = on;
+}
+
+//Allocate BLOCK_SIZE aligned memory that O_DIRECT transfers can use (release with free())
+void *bio_alloc(size_t size) {
+  void *buf = NULL;
+  if (posix_memalign(&buf, BLOCK_SIZE, size) != 0) {
+    return NULL;
+  }
+  return buf;
+}
+
+static int is_aligned(const void *buf, size_t len) {
+  return ((uintptr_t)buf % BLOCK_SIZE) == 0 && (len % BLOCK_SIZE) == 0;
+}
+
+static int iov_aligned(const struct iovec *iov, int iovcnt) {
+  for (int i = 0; i < iovcnt; i++) {
+    if (!is_aligned(iov[i].iov_base, iov[i].iov_len)) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+//Open the disk file, with O_DIRECT if it was asked for and the host file system supports it
+static int dev_open_file(const char* diskfile_path, int flags) {
+  if (direct_io && backend != BIO_BACKEND_MMAP) {
+    int fd = open(diskfile_path, flags | O_DIRECT, S_IRUSR | S_IWUSR);
+    if (fd >= 0 || errno != EINVAL) {
+      return fd;
+    }
+    perror("disk_open with O_DIRECT failed, using buffered I/O");
+  }
+  // a mapped disk goes through the page cache whatever the open flags say
+  direct_io = 0;
+  return open(diskfile_path, flags, S_IRUSR | S_IWUSR);
+}
+
+/*
+ * Set the size the disk file should have. dev_init() creates it with that
+ * size, and dev_open() grows a smaller existing disk up to it (disks never
+ * shrink). The file is extended with ftruncate, so the new space is a hole
+ * that costs no host storage until it is written.
+ */
+void dev_set_size(off_t size) {
+  disk_size = size;
+}
+
+//Size of the open disk file, in bytes
+off_t dev_size() {
+  return disk_size;
+}
+
+//Grow the open disk file to the requested size, then record its actual size
+static void dev_resize() {
+  struct stat st;
+  if (fstat(diskfile, &st) < 0) {
+    perror("disk_stat failed");
+    st.st_size = 0;
+  }
+
+  if (disk_size > st.st_size) {
+    if (ftruncate(diskfile, disk_size) < 0) {
+      perror("disk_resize failed");
+      disk_size = st.st_size;
+    }
+  } else {
+    disk_size = st.st_size;
+  }
+}
+
+//Map the opened disk file, falling back to pread/pwrite if that fails
+static void dev_map() {
+  if (backend != BIO_BACKEND_MMAP || disk_size == 0) {
+    return;
+  }
+
+  disk_map = mmap(NULL, disk_size, PROT_READ | PROT_WRITE, MAP_SHARED, diskfile, 0);
+  if (disk_map == MAP_FAILED) {
+    perror("disk_map failed, using pread/pwrite");
+    disk_map = NULL;
+  }
+}
 
 //Creates a file which is your new emulated disk
 void dev_init(const char* diskfile_path) {
@@ -28,13 +330,20 @@ void dev_init(const char* diskfile_path) {
     return;
   }
 
-  diskfile = open(diskfile_path, O_CREAT | O_RDWR, S_IRUSR | S_IWUSR);
+  diskfile = dev_open_file(diskfile_path, O_CREAT | O_RDWR);
   if (diskfile < 0) {
     perror("disk_open failed");
     exit(EXIT_FAILURE);
   }
 
-  ftruncate(diskfile, DISK_SIZE);
+  if (disk_size == 0) {
+    disk_size = DISK_SIZE;
+  }
+  dev_resize();
+  dev_map();
+#ifdef BIO_HAVE_URING
+  uring_init();
+#endif
 }
 
 //Function to open the disk file
@@ -43,15 +352,27 @@ int dev_open(const char* diskfile_path) {
     return 0;
   }
   
-  diskfile = open(diskfile_path, O_RDWR, S_IRUSR | S_IWUSR);
+  diskfile = dev_open_file(diskfile_path, O_RDWR);
   if (diskfile < 0) {
     perror("disk_open failed");
     return -1;
   }
+  dev_resize();
+  dev_map();
+#ifdef BIO_HAVE_URING
+  uring_init();
+#endif
 	return 0;
 }
 
 void dev_close() {
+#ifdef BIO_HAVE_URING
+  uring_exit();
+#endif
+  if (disk_map != NULL) {
+    munmap(disk_map, disk_size);
+    disk_map = NULL;
+  }
   if (diskfile >= 0) {
     close(diskfile);
   }
@@ -60,6 +381,20 @@ void dev_close() {
 //Read a block from the disk
 int bio_read(const int block_num, void *buf) {
   int retstat = 0;
+  if (disk_map != NULL) {
+    void *blk = bio_map(block_num);
+    if (blk == NULL) {
+      memset(buf, 0, BLOCK_SIZE);
+      return -1;
+    }
+    memcpy(buf, blk, BLOCK_SIZE);
+    return BLOCK_SIZE;
+  }
+  if (direct_io && !is_aligned(buf, BLOCK_SIZE)) {
+    struct iovec iov = { .iov_base = buf, .iov_len = BLOCK_SIZE };
+    return bio_readv(block_num, &iov, 1);
+  }
+
   retstat = pread(diskfile, buf, BLOCK_SIZE, block_num*BLOCK_SIZE);
   if (retstat <= 0) {
     memset (buf, 0, BLOCK_SIZE);
@@ -72,6 +407,19 @@ int bio_read(const int block_num, void *buf) {
 //Write a block to the disk
 int bio_write(const int block_num, const void *buf) {
   int retstat = 0;
+  if (disk_map != NULL) {
+    void *blk = bio_map(block_num);
+    if (blk == NULL) {
+      return -1;
+    }
+    memcpy(blk, buf, BLOCK_SIZE);
+    return BLOCK_SIZE;
+  }
+  if (direct_io && !is_aligned(buf, BLOCK_SIZE)) {
+    struct iovec iov = { .iov_base = (void *)buf, .iov_len = BLOCK_SIZE };
+    return bio_writev(block_num, &iov, 1);
+  }
+
   retstat = pwrite(diskfile, buf, BLOCK_SIZE, block_num*BLOCK_SIZE);
   if (retstat < 0) {
     perror("block_write failed");
@@ -79,3 +427,236 @@ int bio_write(const int block_num, const void *buf) {
   return retstat;
 }
 
+// Move a run that has unaligned buffers through one aligned bounce buffer (O_DIRECT only)
+static int bounce_iov(const int block_num, const struct iovec *iov, int iovcnt, int write) {
+  size_t total = 0;
+  for (int i = 0; i < iovcnt; i++) {
+    total += iov[i].iov_len;
+  }
+
+  struct iovec bounce = { .iov_base = bio_alloc(total), .iov_len = total };
+  if (bounce.iov_base == NULL) {
+    perror("block_bounce failed");
+    return -1;
+  }
+
+  int retstat;
+  size_t pos = 0;
+  if (write) {
+    for (int i = 0; i < iovcnt; pos += iov[i].iov_len, i++) {
+      memcpy((char *)bounce.iov_base + pos, iov[i].iov_base, iov[i].iov_len);
+    }
+    retstat = bio_writev(block_num, &bounce, 1);
+  } else {
+    retstat = bio_readv(block_num, &bounce, 1);
+    for (int i = 0; i < iovcnt; pos += iov[i].iov_len, i++) {
+      memcpy(iov[i].iov_base, (char *)bounce.iov_base + pos, iov[i].iov_len);
+    }
+  }
+
+  free(bounce.iov_base);
+  return retstat;
+}
+
+//Read a run of consecutive blocks, starting at block_num, into the iovec buffers
+int bio_readv(const int block_num, const struct iovec *iov, int iovcnt) {
+  int retstat = 0;
+  if (disk_map != NULL) {
+    char *blk = bio_map(block_num);
+    for (int i = 0; i < iovcnt; i++) {
+      if (blk == NULL || blk + iov[i].iov_len > disk_map + disk_size) {
+        return -1;
+      }
+      memcpy(iov[i].iov_base, blk, iov[i].iov_len);
+      blk += iov[i].iov_len;
+      retstat += iov[i].iov_len;
+    }
+    return retstat;
+  }
+  if (direct_io && !iov_aligned(iov, iovcnt)) {
+    return bounce_iov(block_num, iov, iovcnt, 0);
+  }
+
+  retstat = preadv(diskfile, iov, iovcnt, (off_t)block_num * BLOCK_SIZE);
+  if (retstat < 0) {
+    perror("block_readv failed");
+  }
+
+  // anything past the end of the disk file reads as zeros
+  size_t skip = retstat > 0 ? retstat : 0;
+  for (int i = 0; i < iovcnt; i++) {
+    if (skip >= iov[i].iov_len) {
+      skip -= iov[i].iov_len;
+      continue;
+    }
+    memset((char *)iov[i].iov_base + skip, 0, iov[i].iov_len - skip);
+    skip = 0;
+  }
+
+  return retstat;
+}
+
+//Write the iovec buffers to a run of consecutive blocks, starting at block_num
+int bio_writev(const int block_num, const struct iovec *iov, int iovcnt) {
+  int retstat = 0;
+  if (disk_map != NULL) {
+    char *blk = bio_map(block_num);
+    for (int i = 0; i < iovcnt; i++) {
+      if (blk == NULL || blk + iov[i].iov_len > disk_map + disk_size) {
+        return -1;
+      }
+      memcpy(blk, iov[i].iov_base, iov[i].iov_len);
+      blk += iov[i].iov_len;
+      retstat += iov[i].iov_len;
+    }
+    return retstat;
+  }
+  if (direct_io && !iov_aligned(iov, iovcnt)) {
+    return bounce_iov(block_num, iov, iovcnt, 1);
+  }
+
+  retstat = pwritev(diskfile, iov, iovcnt, (off_t)block_num * BLOCK_SIZE);
+  if (retstat < 0) {
+    perror("block_writev failed");
+  }
+  return retstat;
+}
+
+/*
+ * Read and/or write a batch of blocks. Requests for consecutive blocks in the
+ * same direction are merged into runs, and each run is one vectored I/O.
+ * With io_uring the whole batch costs one submission; otherwise each run is
+ * one bio_readv/bio_writev. Blocks read past the end of the disk file come
+ * back zeroed, as with bio_read. Returns 0 if every request succeeded.
+ */
+int bio_submit(struct bio_req *reqs, int nr) {
+  int retstat = 0;
+
+  if (nr <= 0) {
+    return 0;
+  }
+
+  struct iovec *iovs = malloc(nr * sizeof(struct iovec));
+  struct bio_run *runs = malloc(nr * sizeof(struct bio_run));
+  if (iovs == NULL || runs == NULL) {
+    free(iovs);
+    free(runs);
+    perror("block_submit failed");
+    return -1;
+  }
+
+  int nr_runs = 0;
+  int aligned = 1;
+  for (int i = 0; i < nr; i++) {
+    iovs[i].iov_base = reqs[i].buf;
+    iovs[i].iov_len = BLOCK_SIZE;
+    aligned = aligned && is_aligned(reqs[i].buf, BLOCK_SIZE);
+
+    struct bio_run *last = nr_runs > 0 ? &runs[nr_runs - 1] : NULL;
+    if (last != NULL && last->count < IOV_MAX
+        && reqs[i].write == reqs[i - 1].write
+        && reqs[i].block_num == reqs[i - 1].block_num + 1) {
+      last->count++;
+    } else {
+      runs[nr_runs].first = i;
+      runs[nr_runs].count = 1;
+      nr_runs++;
+    }
+  }
+
+  int done = 0;
+#ifdef BIO_HAVE_URING
+  // with O_DIRECT, io_uring needs aligned buffers too; bio_readv/bio_writev can bounce the rest
+  if (ring_fd >= 0 && disk_map == NULL && (aligned || !direct_io)) {
+    pthread_mutex_lock(&ring_lock);
+    while (done < nr_runs) {
+      int n = uring_submit(reqs, iovs, runs + done, nr_runs - done);
+      if (n < 0) {
+        break;
+      }
+      done += n;
+    }
+    pthread_mutex_unlock(&ring_lock);
+  }
+#endif
+
+  // whatever io_uring didn't take (or all of it, without io_uring) goes one run at a time
+  for (int r = done; r < nr_runs; r++) {
+    struct bio_req *first = &reqs[runs[r].first];
+    if (first->write) {
+      runs[r].result = bio_writev(first->block_num, &iovs[runs[r].first], runs[r].count);
+    } else {
+      runs[r].result = bio_readv(first->block_num, &iovs[runs[r].first], runs[r].count);
+    }
+  }
+
+  // spread each run's byte count back over its requests
+  for (int r = 0; r < nr_runs; r++) {
+    for (int k = 0; k < runs[r].count; k++) {
+      struct bio_req *req = &reqs[runs[r].first + k];
+      long left = (long)runs[r].result - (long)k * BLOCK_SIZE;
+
+      if (runs[r].result < 0) {
+        req->result = runs[r].result;
+      } else {
+        req->result = left >= BLOCK_SIZE ? BLOCK_SIZE : (left > 0 ? left : 0);
+      }
+
+      if (!req->write && req->result >= 0 && req->result < BLOCK_SIZE) {
+        memset((char *)req->buf + req->result, 0, BLOCK_SIZE - req->result);
+      }
+      if (req->result < 0 || (req->write && req->result < BLOCK_SIZE)) {
+        retstat = -1;
+      }
+    }
+    if (runs[r].result < 0) {
+      errno = -runs[r].result;
+      perror(reqs[runs[r].first].write ? "block_write failed" : "block_read failed");
+    }
+  }
+
+  free(iovs);
+  free(runs);
+  return retstat;
+}
+
+/*
+ * Give the host storage behind a run of blocks back by punching a hole in
+ * the disk file; the blocks read back as zeros afterwards. Returns -1 (and
+ * stops trying) if the host file system can't punch holes.
+ */
+int bio_discard(const int block_num, const int count) {
+  if (!can_punch || count <= 0) {
+    return can_punch ? 0 : -1;
+  }
+
+  int retstat = fallocate(diskfile, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                          (off_t)block_num * BLOCK_SIZE, (off_t)count * BLOCK_SIZE);
+  if (retstat < 0) {
+    if (errno == EOPNOTSUPP || errno == ENOSYS) {
+      can_punch = 0;
+    }
+    perror("block_discard failed");
+  }
+  return retstat;
+}
+
+//Get a pointer straight to a block of the mapped disk (NULL with the pread backend)
+void *bio_map(const int block_num) {
+  if (disk_map == NULL || block_num < 0 || (off_t)block_num * BLOCK_SIZE >= disk_size) {
+    return NULL;
+  }
+  return disk_map + (long)block_num * BLOCK_SIZE;
+}
+
+//Make sure blocks written through the mapping have reached the disk file
+int bio_sync() {
+  if (disk_map == NULL) {
+    return 0;
+  }
+  int retstat = msync(disk_map, disk_size, MS_SYNC);
+  if (retstat < 0) {
+    perror("block_sync failed");
+  }
+  return retstat;
+}
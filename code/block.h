@@ -8,12 +8,38 @@
 #ifndef _BLOCK_H_
 #define _BLOCK_H_
 
+#include <sys/types.h>
+#include <sys/uio.h>
+
 #define BLOCK_SIZE 4096
 
+// Ways of reaching the disk file, picked with dev_set_backend() before opening it
+#define BIO_BACKEND_PREAD 0	// copy blocks in and out with pread/pwrite
+#define BIO_BACKEND_MMAP  1	// map the whole disk file and access blocks in place
+
+// One block of a batch handed to bio_submit()
+struct bio_req {
+	int block_num;		/* block to transfer */
+	void *buf;		/* BLOCK_SIZE bytes to read into or write from */
+	int write;		/* 0 to read the block, 1 to write it */
+	int result;		/* filled in by bio_submit(): bytes transferred, or < 0 on error */
+};
+
+void dev_set_backend(int backend);
+void dev_set_direct(int on);
+void dev_set_size(off_t size);
+off_t dev_size();
 void dev_init(const char* diskfile_path);
 int dev_open(const char* diskfile_path);
 void dev_close();
+void *bio_alloc(size_t size);
 int bio_read(const int block_num, void *buf);
 int bio_write(const int block_num, const void *buf);
+int bio_readv(const int block_num, const struct iovec *iov, int iovcnt);
+int bio_writev(const int block_num, const struct iovec *iov, int iovcnt);
+int bio_submit(struct bio_req *reqs, int nr);
+int bio_discard(const int block_num, const int count);
+void *bio_map(const int block_num);
+int bio_sync();
 
 #endif
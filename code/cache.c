@@ -0,0 +1,440 @@
+/*
+ *  Copyright (C) 2023 CS416 Rutgers CS
+ *
+ *	Tiny File System
+ *
+ *	File:	cache.c
+ *
+ *	Write-back block cache that sits between rufs.c and block.c.
+ *	Blocks are hashed by block number and kept on an LRU list; dirty
+ *	blocks only reach the disk when they are evicted or on cache_flush().
+ *	When block.c has the disk file mapped, the mapping already is the
+ *	cache, so every call goes straight through to it.
+ *
+ */
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+
+#include "block.h"
+#include "cache.h"
+
+// Minimum number of blocks kept in the cache, whatever the budget
+#define CACHE_MIN_BLOCKS 16
+
+typedef struct cache_entry {
+  int block_num;                  /* cached block number (-1 if unused) */
+  int dirty;                      /* block differs from the disk copy */
+  int pins;                       /* cache_get() users; pinned blocks are never evicted */
+  struct cache_entry *hnext;      /* next entry in the same hash bucket */
+  struct cache_entry *prev;       /* LRU neighbour towards the head (most recent) */
+  struct cache_entry *next;       /* LRU neighbour towards the tail (least recent) */
+  char *data;                     /* BLOCK_SIZE bytes of block contents */
+} cache_entry_t;
+
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static cache_entry_t *entries = NULL;   // pool of all cache entries
+static char *pool = NULL;               // block storage backing the entries
+static int num_entries = 0;
+static int num_used = 0;                // entries handed out so far (the rest are free)
+
+static cache_entry_t **buckets = NULL;
+static unsigned int bucket_mask = 0;
+
+static cache_entry_t *lru_head = NULL;
+static cache_entry_t *lru_tail = NULL;
+
+static inline unsigned int hash_block(int block_num) {
+  // Knuth's multiplicative hash spreads consecutive block numbers over the table
+  return ((unsigned int)block_num * 2654435761u) & bucket_mask;
+}
+
+static cache_entry_t *hash_lookup(int block_num) {
+  cache_entry_t *e = buckets[hash_block(block_num)];
+  while (e != NULL && e->block_num != block_num) {
+    e = e->hnext;
+  }
+  return e;
+}
+
+static void hash_insert(cache_entry_t *e) {
+  unsigned int h = hash_block(e->block_num);
+  e->hnext = buckets[h];
+  buckets[h] = e;
+}
+
+static void hash_remove(cache_entry_t *e) {
+  cache_entry_t **p = &buckets[hash_block(e->block_num)];
+  while (*p != NULL && *p != e) {
+    p = &(*p)->hnext;
+  }
+  if (*p != NULL) {
+    *p = e->hnext;
+  }
+  e->hnext = NULL;
+}
+
+static void lru_unlink(cache_entry_t *e) {
+  if (e->prev) e->prev->next = e->next; else lru_head = e->next;
+  if (e->next) e->next->prev = e->prev; else lru_tail = e->prev;
+  e->prev = e->next = NULL;
+}
+
+static void lru_push_head(cache_entry_t *e) {
+  e->prev = NULL;
+  e->next = lru_head;
+  if (lru_head) lru_head->prev = e;
+  lru_head = e;
+  if (lru_tail == NULL) lru_tail = e;
+}
+
+static void lru_push_tail(cache_entry_t *e) {
+  e->next = NULL;
+  e->prev = lru_tail;
+  if (lru_tail) lru_tail->next = e;
+  lru_tail = e;
+  if (lru_head == NULL) lru_head = e;
+}
+
+// Write a dirty entry back to the disk
+static int writeback(cache_entry_t *e) {
+  if (!e->dirty) {
+    return 0;
+  }
+  if (bio_write(e->block_num, e->data) < 0) {
+    return -1;
+  }
+  e->dirty = 0;
+  return 0;
+}
+
+/*
+ * Get an entry to hold block_num: an unused one if any are left,
+ * otherwise the least recently used one (written back first if dirty).
+ * The returned entry is hashed under block_num and sits at the LRU head.
+ */
+static cache_entry_t *get_entry(int block_num) {
+  cache_entry_t *e;
+
+  if (num_used < num_entries) {
+    e = &entries[num_used++];
+  } else {
+    // least recently used block that nobody holds a pointer to
+    e = lru_tail;
+    while (e != NULL && e->pins > 0) {
+      e = e->prev;
+    }
+    if (e == NULL || writeback(e) < 0) {
+      return NULL;
+    }
+    lru_unlink(e);
+    hash_remove(e);
+  }
+
+  e->block_num = block_num;
+  e->dirty = 0;
+  e->pins = 0;
+  hash_insert(e);
+  lru_push_head(e);
+  return e;
+}
+
+//Allocate the cache with room for budget bytes worth of blocks
+int cache_init(size_t budget) {
+  if (entries != NULL) {
+    return 0;
+  }
+
+  num_entries = budget / BLOCK_SIZE;
+  if (num_entries < CACHE_MIN_BLOCKS) {
+    num_entries = CACHE_MIN_BLOCKS;
+  }
+
+  // bucket count: power of two at least as large as the number of entries
+  unsigned int num_buckets = 1;
+  while (num_buckets < (unsigned int)num_entries) {
+    num_buckets <<= 1;
+  }
+  bucket_mask = num_buckets - 1;
+
+  entries = calloc(num_entries, sizeof(cache_entry_t));
+  pool = bio_alloc((size_t)num_entries * BLOCK_SIZE);  // aligned, for O_DIRECT
+  buckets = calloc(num_buckets, sizeof(cache_entry_t *));
+  if (!entries || !pool || !buckets) {
+    perror("cache_init failed");
+    cache_destroy();
+    return -1;
+  }
+
+  for (int i = 0; i < num_entries; i++) {
+    entries[i].block_num = -1;
+    entries[i].data = pool + (size_t)i * BLOCK_SIZE;
+  }
+  num_used = 0;
+  lru_head = lru_tail = NULL;
+
+  return 0;
+}
+
+//Release the cache memory (callers flush first if they want the dirty blocks kept)
+void cache_destroy() {
+  free(entries);
+  free(pool);
+  free(buckets);
+  entries = NULL;
+  pool = NULL;
+  buckets = NULL;
+  num_entries = num_used = 0;
+  lru_head = lru_tail = NULL;
+}
+
+// Find block_num in the cache, reading it from the disk on a miss (cache_lock held)
+static cache_entry_t *lookup(int block_num) {
+  cache_entry_t *e = hash_lookup(block_num);
+  if (e != NULL) {
+    lru_unlink(e);
+    lru_push_head(e);
+    return e;
+  }
+
+  e = get_entry(block_num);
+  if (e != NULL && bio_read(block_num, e->data) < 0) {
+    // don't keep a block we failed to read; make it the next victim
+    hash_remove(e);
+    e->block_num = -1;
+    lru_unlink(e);
+    lru_push_tail(e);
+    e = NULL;
+  }
+  return e;
+}
+
+//Read a block, from the cache if present, otherwise from the disk
+int cache_read(const int block_num, void *buf) {
+  if (bio_map(block_num) != NULL) {
+    return bio_read(block_num, buf);
+  }
+
+  pthread_mutex_lock(&cache_lock);
+  cache_entry_t *e = lookup(block_num);
+  if (e == NULL) {
+    pthread_mutex_unlock(&cache_lock);
+    memset(buf, 0, BLOCK_SIZE);
+    return -1;
+  }
+
+  memcpy(buf, e->data, BLOCK_SIZE);
+  pthread_mutex_unlock(&cache_lock);
+  return BLOCK_SIZE;
+}
+
+/*
+ * Get a read-only pointer to a block without copying it out.
+ * The block stays pinned in the cache until the matching cache_put().
+ */
+const void *cache_get(const int block_num) {
+  const void *blk = bio_map(block_num);
+  if (blk != NULL) {
+    return blk;
+  }
+
+  pthread_mutex_lock(&cache_lock);
+  cache_entry_t *e = lookup(block_num);
+  if (e != NULL) {
+    e->pins++;
+    blk = e->data;
+  }
+  pthread_mutex_unlock(&cache_lock);
+  return blk;
+}
+
+//Release a block pinned by cache_get()
+void cache_put(const int block_num) {
+  if (bio_map(block_num) != NULL) {
+    return;
+  }
+
+  pthread_mutex_lock(&cache_lock);
+  cache_entry_t *e = hash_lookup(block_num);
+  if (e != NULL && e->pins > 0) {
+    e->pins--;
+  }
+  pthread_mutex_unlock(&cache_lock);
+}
+
+//Write a block into the cache; it reaches the disk on eviction or cache_flush()
+int cache_write(const int block_num, const void *buf) {
+  if (bio_map(block_num) != NULL) {
+    return bio_write(block_num, buf);
+  }
+
+  pthread_mutex_lock(&cache_lock);
+
+  cache_entry_t *e = hash_lookup(block_num);
+  if (e != NULL) {
+    lru_unlink(e);
+    lru_push_head(e);
+  } else {
+    // whole-block write, so there is no need to read the old contents first
+    e = get_entry(block_num);
+    if (e == NULL) {
+      pthread_mutex_unlock(&cache_lock);
+      return -1;
+    }
+  }
+
+  memcpy(e->data, buf, BLOCK_SIZE);
+  e->dirty = 1;
+  pthread_mutex_unlock(&cache_lock);
+  return BLOCK_SIZE;
+}
+
+static int compare_int(const void *a, const void *b) {
+  int x = *(const int *)a;
+  int y = *(const int *)b;
+  return (x > y) - (x < y);
+}
+
+//Forget a block without writing it back, because its contents no longer matter (e.g. it was freed)
+void cache_discard(const int block_num) {
+  if (bio_map(block_num) != NULL) {
+    return;
+  }
+
+  pthread_mutex_lock(&cache_lock);
+  cache_entry_t *e = hash_lookup(block_num);
+  if (e != NULL) {
+    e->dirty = 0;
+    // a pinned copy stays cached, so make it read like the hole the block now is
+    memset(e->data, 0, BLOCK_SIZE);
+    if (e->pins == 0) {
+      hash_remove(e);
+      e->block_num = -1;
+      lru_unlink(e);
+      lru_push_tail(e);
+    }
+  }
+  pthread_mutex_unlock(&cache_lock);
+}
+
+/*
+ * Bring a set of blocks into the cache with a single bio_submit() batch.
+ * Blocks already cached, and block numbers <= 0 (unused pointers), are
+ * skipped. The misses are fetched in block order, so the ones that are
+ * contiguous on disk are read with one vectored read per run.
+ * The blocks are only prefetched, callers still cache_read/get them.
+ */
+int cache_prefetch(const int *blocks, int nr) {
+  if (nr <= 0 || bio_map(0) != NULL) {
+    return 0;
+  }
+
+  int *sorted = malloc(nr * sizeof(int));
+  cache_entry_t **misses = malloc(nr * sizeof(cache_entry_t *));
+  struct bio_req *reqs = malloc(nr * sizeof(struct bio_req));
+  if (sorted == NULL || misses == NULL || reqs == NULL) {
+    free(sorted);
+    free(misses);
+    free(reqs);
+    return -1;
+  }
+  memcpy(sorted, blocks, nr * sizeof(int));
+  qsort(sorted, nr, sizeof(int), compare_int);
+
+  pthread_mutex_lock(&cache_lock);
+
+  int num_misses = 0;
+  for (int i = 0; i < nr; i++) {
+    if (sorted[i] <= 0 || hash_lookup(sorted[i]) != NULL) {
+      continue;
+    }
+    cache_entry_t *e = get_entry(sorted[i]);
+    if (e == NULL) {
+      break;
+    }
+    // pin it so that fetching the rest of the batch can't evict it
+    e->pins++;
+    misses[num_misses] = e;
+    reqs[num_misses].block_num = e->block_num;
+    reqs[num_misses].buf = e->data;
+    reqs[num_misses].write = 0;
+    num_misses++;
+  }
+
+  int retstat = bio_submit(reqs, num_misses);
+
+  for (int i = 0; i < num_misses; i++) {
+    cache_entry_t *e = misses[i];
+    e->pins--;
+    if (reqs[i].result < 0) {
+      hash_remove(e);
+      e->block_num = -1;
+      lru_unlink(e);
+      lru_push_tail(e);
+    }
+  }
+
+  pthread_mutex_unlock(&cache_lock);
+  free(sorted);
+  free(misses);
+  free(reqs);
+  return retstat;
+}
+
+static int compare_block_num(const void *a, const void *b) {
+  const cache_entry_t *x = *(cache_entry_t * const *)a;
+  const cache_entry_t *y = *(cache_entry_t * const *)b;
+  return (x->block_num > y->block_num) - (x->block_num < y->block_num);
+}
+
+/*
+ * Write every dirty block back to the disk, in block order, as one batch;
+ * runs of consecutive dirty blocks each become a single vectored write.
+ */
+int cache_flush() {
+  if (bio_map(0) != NULL) {
+    return bio_sync();
+  }
+
+  pthread_mutex_lock(&cache_lock);
+
+  cache_entry_t **dirty = malloc((size_t)num_used * sizeof(cache_entry_t *));
+  struct bio_req *reqs = malloc((size_t)num_used * sizeof(struct bio_req));
+  if (num_used > 0 && (dirty == NULL || reqs == NULL)) {
+    pthread_mutex_unlock(&cache_lock);
+    free(dirty);
+    free(reqs);
+    perror("cache_flush failed");
+    return -1;
+  }
+
+  int num_dirty = 0;
+  for (int i = 0; i < num_used; i++) {
+    if (entries[i].dirty) {
+      dirty[num_dirty++] = &entries[i];
+    }
+  }
+  qsort(dirty, num_dirty, sizeof(cache_entry_t *), compare_block_num);
+
+  for (int i = 0; i < num_dirty; i++) {
+    reqs[i].block_num = dirty[i]->block_num;
+    reqs[i].buf = dirty[i]->data;
+    reqs[i].write = 1;
+  }
+  int retstat = bio_submit(reqs, num_dirty);
+
+  // only blocks that made it to the disk are clean now
+  for (int i = 0; i < num_dirty; i++) {
+    if (reqs[i].result == BLOCK_SIZE) {
+      dirty[i]->dirty = 0;
+    }
+  }
+
+  free(dirty);
+  free(reqs);
+  pthread_mutex_unlock(&cache_lock);
+  return retstat;
+}
@@ -0,0 +1,26 @@
+/*
+ *  Copyright (C) 2023 CS416 Rutgers CS
+ *	Tiny File System
+ *	File:	cache.h
+ *
+ */
+
+#ifndef _CACHE_H_
+#define _CACHE_H_
+
+#include <stddef.h>
+
+// Default memory budget of the block cache (8MB)
+#define CACHE_DEFAULT_SIZE (8*1024*1024)
+
+int cache_init(size_t budget);
+void cache_destroy();
+int cache_read(const int block_num, void *buf);
+int cache_write(const int block_num, const void *buf);
+const void *cache_get(const int block_num);
+void cache_put(const int block_num);
+int cache_prefetch(const int *blocks, int nr);
+void cache_discard(const int block_num);
+int cache_flush();
+
+#endif
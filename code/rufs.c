@@ -8,15 +8,18 @@
 #define FUSE_USE_VERSION 26
 
 
+#include <endian.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <fuse.h>
+#include <fuse_lowlevel.h>
 #include <libgen.h>
 #include <limits.h>
 #include <math.h>
 #include <pthread.h>
 #include <stdatomic.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -26,21 +29,122 @@
 #include <unistd.h>
 
 #include "block.h"
+#include "cache.h"
 #include "rufs.h"
 
 
-// MAX_DIRENTS --> max number of dirents a directory can hold
-#define MAX_DIRENTS ((BLOCK_SIZE / sizeof(dirent_t)) * NUM_DIRECT_PTRS)  // 16 denotes the amount of direct pointers in an inode
-#define MAX_DIRENTS_IN_BLOCK ((BLOCK_SIZE / sizeof(dirent_t)))
-
 char diskfile_path[PATH_MAX];
 
+// Mount options (-o name=value), parsed in main() before fuse_main()
+struct rufs_config {
+    unsigned int cache_size;  // block cache budget in KB
+    int use_mmap;             // access the disk file through mmap instead of pread/pwrite
+    int use_odirect;          // open the disk file with O_DIRECT, leaving caching to the block cache
+    unsigned int disk_size;   // disk size in MB: size of a new disk, or what to grow an existing one to
+    int use_blockmap;         // new disk: files map their blocks with indirect pointers, not extents
+    unsigned int path_cache;  // entries of the path cache (0: none)
+    int use_lowlevel;         // serve through the low-level FUSE API (by inode) instead of by path
+    int debug;                // -d / -o debug (also passed on to FUSE): report cache statistics at unmount
+};
+
+static struct rufs_config config = {
+    .cache_size = CACHE_DEFAULT_SIZE / 1024,
+    .path_cache = 4096,
+};
+
+#define RUFS_OPT(t, p, v) {t, offsetof(struct rufs_config, p), v}
+
+static struct fuse_opt rufs_opts[] = {
+    RUFS_OPT("cache_size=%u", cache_size, 0),
+    RUFS_OPT("mmap", use_mmap, 1),
+    RUFS_OPT("odirect", use_odirect, 1),
+    RUFS_OPT("disk_size=%u", disk_size, 0),
+    RUFS_OPT("blockmap", use_blockmap, 1),
+    RUFS_OPT("path_cache=%u", path_cache, 0),
+    RUFS_OPT("lowlevel", use_lowlevel, 1),
+    RUFS_OPT("-d", debug, 1),
+    RUFS_OPT("debug", debug, 1),
+    FUSE_OPT_KEY("-d", FUSE_OPT_KEY_KEEP),
+    FUSE_OPT_KEY("debug", FUSE_OPT_KEY_KEEP),
+    FUSE_OPT_END};
+
 // Declare your in-memory data structures here
 
 atomic_flag init = ATOMIC_FLAG_INIT;
 static superblock_t superblock;
-static char i_bitmap[I_BITMAP_SIZE];
-static char d_bitmap[D_BITMAP_SIZE];
+static int superblock_dirty = 0;  // an inode chunk was added since the superblock was last written back
+static pthread_mutex_t superblock_lock = PTHREAD_MUTEX_INITIALIZER;
+/*
+ * Both bitmaps stay resident from my_init() on. They are kept as 64-bit words so that
+ * a free bit can be found a word at a time, and they are only written back to disk
+ * (by sync_bitmaps()) when they are dirty and the file system is flushed.
+ * Each block group's bitmap blocks are one slice of them: bit i of group g's inode bitmap
+ * is inode number (g * inodes_per_group) + i, and bit i of its data block bitmap is
+ * bit (g * data_per_group) + i of d_bitmap (see data_blkno()).
+ */
+static uint64_t i_bitmap[I_BITMAP_SIZE / sizeof(uint64_t)];
+static uint64_t d_bitmap[D_BITMAP_SIZE / sizeof(uint64_t)];
+
+/*
+ * Free space of the data region as an array of extents (runs of free data blocks)
+ * ordered by start block, kept in step with d_bitmap. Data blocks are handed out
+ * from here, so a request for several blocks near a goal block can be served as one run.
+ * Block numbers in an extent are bits of d_bitmap.
+ */
+typedef struct extent {
+    int start;  // first free block of the run
+    int len;    // number of free blocks in the run
+} extent_t;
+
+/*
+ * The inodes and data blocks of each block group are allocated as a group, which owns
+ * the group's slice of its bitmap (a whole number of 64-bit words, so groups never share
+ * a word) with its own lock and free counter. Allocations go to the group of a goal (a file's
+ * inodes and blocks near its directory's) or else to the group the thread has affinity with,
+ * and only move on to the other groups when that one runs dry, so concurrent creates and
+ * writes mostly take different locks (main() still serves requests one at a time, until
+ * the directory and file paths can run side by side).
+ */
+typedef struct alloc_group {
+    pthread_mutex_t lock;
+    int first;          // first bit of the group's slice of the bitmap
+    int nbits;          // number of bits in the slice
+    int free;           // how many of them are clear (read without the lock to skip full groups)
+    int hint;           // where an allocation without a goal starts (just past the last one)
+    int dirty;          // the slice changed since it was last written to the group's bitmap block
+    extent_t *extents;  // data groups: the free runs of the slice, ordered by start
+    int num_extents;
+} alloc_group_t;
+
+static alloc_group_t i_groups[MAX_GROUPS];
+static int num_i_groups = 0;
+static alloc_group_t d_groups[MAX_GROUPS];
+static int num_d_groups = 0;
+
+static int next_affinity = 0;
+static __thread int thread_affinity = -1;
+
+/*
+ * Delayed allocation: data written into blocks a file doesn't have yet stays in memory,
+ * with a data block reserved for it but not yet placed, until the file is flushed or
+ * released (or the pending data passes DELALLOC_MAX_BLOCKS). Only then are its blocks
+ * allocated, each stretch of them with one alloc_blocks() call, so a file written a
+ * piece at a time still gets contiguous blocks, and one removed before that never gets any.
+ */
+#define DELALLOC_MAX_BLOCKS 1024  // 4MB of pending data over all files
+#define DELALLOC_META_BLOCKS 8     // left unreserved, for the mapping blocks placing pending data needs
+
+typedef struct delalloc {
+    int ino;
+    int nslots;
+    char **data;  // pending contents of the blocks the file doesn't have yet, by logical block
+    struct delalloc *next;
+} delalloc_t;
+
+static delalloc_t *delalloc_list = NULL;
+static int delalloc_blocks = 0;  // pending blocks over all files, each one holds a reservation
+static pthread_mutex_t delalloc_lock = PTHREAD_MUTEX_INITIALIZER;
+
 /* will hold a block (or blocks), depending on size allocated, that will need to be read or written to memory */
 char *buff_mem;
 
@@ -48,604 +152,2989 @@ int inodes_in_use = 0;  // book-keeping variable (may not be needed)
 int superblock_index;
 int i_bitmap_index;
 int d_bitmap_index;
-int inode_table_index;
 int data_block_start;
 int inodes_in_block;
 int root_inode;
 
-int num_of_components(char *path_interest, char **parts_of_path) {
-    char path[1024];
-    strcpy(path, path_interest);
+// Freed data blocks waiting to have their host storage given back (see punch_freed_blocks())
+#define PUNCH_BATCH 256
+static int punch_list[PUNCH_BATCH];
+static int punch_count = 0;
+static pthread_mutex_t punch_lock = PTHREAD_MUTEX_INITIALIZER;
 
-    if (strcmp(path, "/") == 0) {
-        // 0 indicates that the path is simply the root directory
-
-        return 0;
+/*
+ * Find a clear bit among the first nbits of a bitmap and set it, a 64-bit word at a time.
+ * The search starts at *hint and wraps around, and *hint is moved just past the bit found,
+ * so consecutive allocations don't rescan the full words at the front of the bitmap.
+ * returns -1 if every bit is set
+ */
+static int find_free_bit(uint64_t *bitmap, int nbits, int *hint) {
+    int nwords = (nbits + 63) / 64;
+    if (nwords == 0) {
+        return -1;
     }
 
-    // char* parts[BLOCK_SIZE];
-    char *token;
-    char *delim = "/";
-    int count = 0;
-
-    token = strtok(path, delim);
+    int start = (*hint < nbits) ? (*hint / 64) : 0;
+    for (int n = 0; n <= nwords; n++) {
+        int w = (start + n) % nwords;
 
-    while (token != NULL) {
-        parts_of_path[count] = strdup(token);
+        // bitmaps are little-endian on disk (bit i lives in byte i / 8), whatever the host is
+        uint64_t free_bits = ~le64toh(bitmap[w]);
+        if (w == nwords - 1 && nbits % 64 != 0) {
+            free_bits &= (1ULL << (nbits % 64)) - 1;  // bits past nbits don't exist
+        }
+        if (n == 0) {
+            free_bits &= ~0ULL << (*hint % 64);  // first pass over the start word: only from the hint on
+        }
+        if (free_bits == 0) {
+            continue;
+        }
 
-        token = strtok(NULL, delim);
-        count++;
+        int i = (w * 64) + __builtin_ctzll(free_bits);
+        set_bitmap((bitmap_t)bitmap, i);
+        *hint = i + 1;
+        return i;
     }
 
-    if (count == 0) {
-        // return -1 to indicate the path passed in was invalid or something went wrong
+    return -1;
+}
 
-        return -1;
-    } else {
-        return count;
-    }
+static int64_t timespec_to_ns(const struct timespec *ts) {
+    return ((int64_t)ts->tv_sec * 1000000000LL) + ts->tv_nsec;
+}
+
+// the current time, the way inodes keep it (ns since the epoch)
+static int64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return timespec_to_ns(&ts);
+}
+
+static struct timespec ns_to_timespec(int64_t ns) {
+    struct timespec ts = {.tv_sec = ns / 1000000000LL, .tv_nsec = ns % 1000000000LL};
+    return ts;
 }
 
 /*
- * Get available inode number from bitmap
-    returns -1 to indicate failure, else returns the inode position found that was available
+ * Block group geometry: group g's blocks are where group 0's are, g * blocks_per_group further on
  */
-int get_avail_ino() {
-    // Step 1: Read inode bitmap from disk
-    memset(buff_mem, 0, BUFF_MEM_SIZE);
-    int read_ret_stat = bio_read(i_bitmap_index, buff_mem);
-    if (read_ret_stat < 0) {
+static int group_blkno(int g, int group0_blk) {
+    return group0_blk + (g * superblock.blocks_per_group);
+}
+
+// the block of the inode table holding an inode (-1 if its chunk has no blocks yet)
+static int inode_blkno(int ino) {
+    int g = ino / superblock.inodes_per_group;
+    int i = ino % superblock.inodes_per_group;
+    if (ino < 0 || g >= superblock.groups) {
         return -1;
     }
 
-    // Step 2: Traverse inode bitmap to find an available slot
-    for (int i = 0; i < I_BITMAP_SIZE; i++) {
-        /* NOTE: buff_mem here only holds the i_bitmap, and the loop will only go as far as
-                the length of this i_bitmap, so it's okay to pass buff_mem here*/
+    int chunk = __atomic_load_n(&superblock.inode_chunks[g][i / INODES_PER_CHUNK], __ATOMIC_ACQUIRE);
+    if (chunk == 0) {
+        return -1;
+    }
+    return chunk + ((i % INODES_PER_CHUNK) / inodes_in_block);
+}
 
-        if (get_bitmap(buff_mem, i) == 0) {
-            // if a free bit is found, set it to allocated
+// the data block a bit of d_bitmap stands for
+static int data_blkno(int bit) {
+    int g = bit / superblock.data_per_group;
+    return group_blkno(g, data_block_start) + (bit % superblock.data_per_group);
+}
 
-            // Step 3: Update inode bitmap and write to disk
-            set_bitmap(buff_mem, i);
+// the bit of d_bitmap standing for a data block
+static int data_bit(int blkno) {
+    int rel = blkno - data_block_start;
+    return ((rel / superblock.blocks_per_group) * superblock.data_per_group) + (rel % superblock.blocks_per_group);
+}
 
-            int write_ret_stat = bio_write(i_bitmap_index, buff_mem);
-            if (write_ret_stat < 0) {
-                return -1;
-            }
-            memset(buff_mem, 0, BUFF_MEM_SIZE);  // clear buffer once done with it
+static int is_data_blkno(int blkno) {
+    int rel = blkno - data_block_start;
+    return rel >= 0 && (rel % superblock.blocks_per_group) < superblock.data_per_group && data_bit(blkno) < superblock.max_dnum;
+}
+
+static int ino_group(int ino) {
+    return ino / superblock.inodes_per_group;
+}
 
-            return i;
+/*
+ * The group for a new directory's inode: the one with the most free inodes, so that
+ * directories (and the files that go with them) spread out over the disk
+ */
+static int dir_group() {
+    int best = 0;
+    for (int g = 1; g < num_i_groups; g++) {
+        if (__atomic_load_n(&i_groups[g].free, __ATOMIC_RELAXED) > __atomic_load_n(&i_groups[best].free, __ATOMIC_RELAXED)) {
+            best = g;
         }
     }
-
-    // if we get to here, return EXIT_FAILURE to indicate no free inode was found
-
-    return -1;
+    return best;
 }
 
 /*
- * Get available data block number from bitmap
+ * The group (of ngroups) the calling thread allocates from first: threads are
+ * spread over the groups round robin the first time they allocate
  */
-int get_avail_blkno() {
-    // Step 1: Read data block bitmap from disk
-    memset(buff_mem, 0, BUFF_MEM_SIZE);
-    int read_ret_stat = bio_read(d_bitmap_index, buff_mem);
-    if (read_ret_stat < 0) {
-        return -1;
+static int thread_group(int ngroups) {
+    if (thread_affinity == -1) {
+        thread_affinity = __atomic_fetch_add(&next_affinity, 1, __ATOMIC_RELAXED);
     }
+    return thread_affinity % ngroups;
+}
 
-    // Step 2: Traverse data block bitmap to find an available slot
-    for (int i = 0; i < D_BITMAP_SIZE; i++) {
-        if (get_bitmap(buff_mem, i) == 0) {
-            // if a free bit is found, set to allocated
-            set_bitmap(buff_mem, i);
-
-            // Step 3: Update data block bitmap and write to disk
-            int write_ret_stat = bio_write(d_bitmap_index, buff_mem);
-            if (write_ret_stat < 0) {
-                return -1;
-            }
-
-            memset(buff_mem, 0, BUFF_MEM_SIZE);  // clear buffer once done with it
-
-            return i + data_block_start;
-            // return i;
+/*
+ * index of the last free extent of the group starting at or before blk (-1 if there is none)
+ */
+static int find_extent(alloc_group_t *group, int blk) {
+    int lo = 0;
+    int hi = group->num_extents - 1;
+    int found = -1;
+    while (lo <= hi) {
+        int mid = (lo + hi) / 2;
+        if (group->extents[mid].start <= blk) {
+            found = mid;
+            lo = mid + 1;
+        } else {
+            hi = mid - 1;
         }
     }
-
-    // if we get to here, return EXIT_FAILURE to indicate no free data block was found
-    return -1;
+    return found;
 }
 
 /*
- * inode operations:
- * given an inode number, return that inode from disk
+ * Take count blocks starting at blk out of free extent idx of the group (they must
+ * all be in it), and mark them allocated in the data block bitmap
  */
-int readi(uint16_t ino, struct inode *inode) {
-    // Step 1: Get the inode's on-disk block number
-
-    // inode table starts at block 3, add this to the target block
-    int inode_block_num = inode_table_index + (ino / inodes_in_block);
-
-    // Step 2: Get offset of the inode in the inode on-disk block
-    int offset_in_block = (ino % inodes_in_block);
+static void take_from_extent(alloc_group_t *group, int idx, int blk, int count) {
+    extent_t *e = &group->extents[idx];
+    int end = e->start + e->len;
+
+    if (blk == e->start) {
+        e->start += count;
+        e->len -= count;
+        if (e->len == 0) {
+            memmove(e, e + 1, (group->num_extents - idx - 1) * sizeof(extent_t));
+            group->num_extents--;
+        }
+    } else if (blk + count == end) {
+        e->len -= count;
+    } else {
+        // taken from the middle: what's left after the run becomes an extent of its own
+        memmove(e + 2, e + 1, (group->num_extents - idx - 1) * sizeof(extent_t));
+        group->num_extents++;
+        e[1].start = blk + count;
+        e[1].len = end - (blk + count);
+        e->len = blk - e->start;
+    }
 
-    // Step 3: Read the block from disk and then copy into inode structure
+    for (int i = blk; i < blk + count; i++) {
+        set_bitmap((bitmap_t)d_bitmap, i);
+    }
+    __atomic_sub_fetch(&group->free, count, __ATOMIC_RELAXED);
+    group->dirty = 1;
+}
 
-    // read the block to the buffer
-    memset(buff_mem, 0, BUFF_MEM_SIZE);
+/*
+ * Put a freed block back into its group's free extents, merging it with its neighbours
+ */
+static void give_to_extents(alloc_group_t *group, int blk) {
+    extent_t *extents = group->extents;
+    int idx = find_extent(group, blk);
+    int joins_prev = (idx >= 0 && extents[idx].start + extents[idx].len == blk);
+    int joins_next = (idx + 1 < group->num_extents && extents[idx + 1].start == blk + 1);
+
+    if (idx >= 0 && blk < extents[idx].start + extents[idx].len) {
+        return;  // already free
+    }
 
-    int read_ret_stat = bio_read(inode_block_num, buff_mem);
+    if (joins_prev && joins_next) {
+        extents[idx].len += 1 + extents[idx + 1].len;
+        memmove(&extents[idx + 1], &extents[idx + 2], (group->num_extents - idx - 2) * sizeof(extent_t));
+        group->num_extents--;
+    } else if (joins_prev) {
+        extents[idx].len++;
+    } else if (joins_next) {
+        extents[idx + 1].start--;
+        extents[idx + 1].len++;
+    } else {
+        memmove(&extents[idx + 2], &extents[idx + 1], (group->num_extents - idx - 1) * sizeof(extent_t));
+        extents[idx + 1].start = blk;
+        extents[idx + 1].len = 1;
+        group->num_extents++;
+    }
+    __atomic_add_fetch(&group->free, 1, __ATOMIC_RELAXED);
+}
 
-    if (read_ret_stat < 0) {
+/*
+ * Build the free extents of a data group from its slice of the data block bitmap
+ */
+static int build_free_extents(alloc_group_t *group) {
+    // a bitmap of alternating bits is the worst case: one extent per two blocks
+    group->extents = malloc(((group->nbits / 2) + 1) * sizeof(extent_t));
+    if (group->extents == NULL) {
         return EXIT_FAILURE;
     }
 
-    inode_t temp;
-    memcpy(&temp, buff_mem + (sizeof(inode_t) * offset_in_block), sizeof(inode_t));
+    group->num_extents = 0;
+    group->free = 0;
+    int end = group->first + group->nbits;
+    int i = group->first;
+    while (i < end) {
+        // skip over whole words of allocated blocks
+        if (i % 64 == 0 && d_bitmap[i / 64] == ~0ULL) {
+            i += 64;
+            continue;
+        }
+        if (get_bitmap((bitmap_t)d_bitmap, i) != 0) {
+            i++;
+            continue;
+        }
 
-    *inode = temp;
+        int start = i;
+        while (i < end && get_bitmap((bitmap_t)d_bitmap, i) == 0) {
+            i++;
+        }
+        group->extents[group->num_extents].start = start;
+        group->extents[group->num_extents].len = i - start;
+        group->num_extents++;
+        group->free += i - start;
+    }
 
     return EXIT_SUCCESS;
 }
 
-int writei(uint16_t ino, struct inode *inode) {
-    // Step 1: Get the block number where this inode resides on disk
-
-    int inode_block_num = inode_table_index + (ino / inodes_in_block);
-
-    // Step 2: Get the offset in the block where this inode resides on disk
-    int offset_in_block = (ino % inodes_in_block);
-
-    // Step 3: Write inode to disk
-
-    // read the target block into buff_mem
-    memset(buff_mem, 0, BUFF_MEM_SIZE);
-    int read_ret_stat = bio_read(inode_block_num, buff_mem);
-    if (read_ret_stat < 0) {
-        return EXIT_FAILURE;
+static void free_alloc_groups() {
+    for (int i = 0; i < num_i_groups; i++) {
+        pthread_mutex_destroy(&i_groups[i].lock);
     }
-    // offset into buff_mem (which holds the target block), then save the inode there
-    memcpy((buff_mem + (offset_in_block * sizeof(inode_t))), inode, sizeof(inode_t));  // double check this
-    for (int i = 0; i <= ino; i++) {
-        inode_t *temp = buff_mem + i * sizeof(inode_t);
+    for (int i = 0; i < num_d_groups; i++) {
+        pthread_mutex_destroy(&d_groups[i].lock);
+        free(d_groups[i].extents);
+        d_groups[i].extents = NULL;
     }
-    int write_ret_stat = bio_write(inode_block_num, buff_mem);
-    if (write_ret_stat < 0) {
-        return EXIT_FAILURE;
+    num_i_groups = num_d_groups = 0;
+}
+
+/*
+ * Set up an allocation group for the inodes and the data blocks of each block group,
+ * and count what is free in each from the resident bitmaps (at mount, and after mkfs)
+ */
+static int setup_alloc_groups() {
+    free_alloc_groups();
+
+    for (int first = 0; first < superblock.max_inum; first += superblock.inodes_per_group) {
+        alloc_group_t *group = &i_groups[num_i_groups++];
+        pthread_mutex_init(&group->lock, NULL);
+        group->first = first;
+        group->nbits = superblock.inodes_per_group;
+        group->hint = 0;
+        group->dirty = 0;
+        group->free = 0;
+        for (int i = first; i < first + group->nbits; i++) {
+            group->free += (get_bitmap((bitmap_t)i_bitmap, i) == 0);
+        }
+        group->extents = NULL;
     }
-    memset(buff_mem, 0, BUFF_MEM_SIZE);
 
-    bio_read(inode_block_num, buff_mem);
-    for (int i = 0; i <= ino; i++) {
-        inode_t *temp = buff_mem + i * sizeof(inode_t);
+    for (int first = 0; first < superblock.max_dnum; first += superblock.data_per_group) {
+        alloc_group_t *group = &d_groups[num_d_groups++];
+        pthread_mutex_init(&group->lock, NULL);
+        group->first = first;
+        group->nbits = superblock.max_dnum - first;
+        if (group->nbits > superblock.data_per_group) {
+            group->nbits = superblock.data_per_group;  // all but the last group are full size
+        }
+        group->hint = first;
+        group->dirty = 0;
+        if (build_free_extents(group) != EXIT_SUCCESS) {
+            return EXIT_FAILURE;
+        }
     }
-    memset(buff_mem, 0, BUFF_MEM_SIZE);
 
     return EXIT_SUCCESS;
 }
 
 /*
- * 	directory operations:
-        given the ino of the current directory,
-        check to see if a desired file or sub-directory exists,
-                if so, then save to struct dirent *dirent
+ * Allocate up to want contiguous blocks from one data group (its lock held), as close
+ * to the goal block as possible (goal -1: no preference). In order of preference the run:
+ *      - starts right at goal, if goal is free (as far as the free extent goes)
+ *      - is the first extent after goal with room for all want blocks
+ *      - is the largest extent of the group, if no extent has room for all of them
+ * returns the first block of the run (as a bit of d_bitmap) and its length in *got
  */
-int dir_find(uint16_t ino, const char *fname, size_t name_len, struct dirent *dirent) {
-    // Step 1: Call readi() to get the inode using ino (inode number of current directory)
+static int alloc_from_group(alloc_group_t *group, int goal, int want, int *got) {
+    if (group->num_extents == 0) {
+        return -1;
+    }
 
-    inode_t temp_inode;
-    int ret_stat = readi(ino, &temp_inode);
-    if (ret_stat == EXIT_FAILURE) {
-        return EXIT_FAILURE;
+    int g = (goal >= 0) ? goal : group->hint;
+    int idx = find_extent(group, g);
+    int blk, count;
+
+    if (idx >= 0 && g < group->extents[idx].start + group->extents[idx].len) {
+        blk = g;
+        count = group->extents[idx].start + group->extents[idx].len - g;
+    } else {
+        int after = idx + 1;  // first extent past the goal, the search wraps around from there
+        int largest = 0;
+        idx = -1;
+        for (int n = 0; n < group->num_extents; n++) {
+            int e = (after + n) % group->num_extents;
+            if (group->extents[e].len >= want) {
+                idx = e;
+                break;
+            }
+            if (group->extents[e].len > group->extents[largest].len) {
+                largest = e;
+            }
+        }
+        if (idx == -1) {
+            idx = largest;
+        }
+        blk = group->extents[idx].start;
+        count = group->extents[idx].len;
     }
 
-    // Step 2: Get data block of current directory from inode
-    for (int i = 0; i < 16; i++) {
-        // traverse through the direct_ptr array (NOTE: there are only 16 direct blocks in an inode)
-        if (temp_inode.direct_ptr[i] >= data_block_start) {  // NOTE: valid data blocks are >= 67
+    if (count > want) {
+        count = want;
+    }
+    take_from_extent(group, idx, blk, count);
+    group->hint = blk + count;
 
-            // if the index points to a valid (data) block, read that block to buff_mem:
-            memset(buff_mem, 0, BUFF_MEM_SIZE);
+    *got = count;
+    return blk;
+}
 
-            // read the data block into buff mem
-            int read_ret_stat = bio_read(temp_inode.direct_ptr[i], buff_mem);
+/*
+ * Allocate up to want contiguous data blocks near the goal block (goal -1: no preference).
+ * The goal's group is tried first, without a goal this thread's group is; when that
+ * group has no room the other groups are tried in turn.
+ * returns the first block of the run and its length in *got, or -1 if the disk is full
+ */
+int alloc_blocks(int goal, int want, int *got) {
+    if (want <= 0 || num_d_groups == 0) {
+        return -1;
+    }
 
-            if (read_ret_stat < 0) {
-                return EXIT_FAILURE;
-            }
+    // a goal just past the end of a group's data blocks (on the next group's bitmaps)
+    // still says which group to try first
+    int has_goal = is_data_blkno(goal);
+    int goal_group = (goal - data_block_start) / (int)superblock.blocks_per_group;
+    int start = (goal >= data_block_start && goal_group < num_d_groups) ? goal_group : thread_group(num_d_groups);
+    for (int n = 0; n < num_d_groups; n++) {
+        alloc_group_t *group = &d_groups[(start + n) % num_d_groups];
+        if (__atomic_load_n(&group->free, __ATOMIC_RELAXED) == 0) {
+            continue;
+        }
 
-            dirent_t temp_dirent;
-            /*
-                    will need to check how this conditional performs
-                    ==> since (BLOCK_SIZE/sizeof(dirent_t)) ==> (4096 / 214) = 19.14
-
-                    it might read past the given block accidentally
-            */
-
-            // switched to this way instead:
-            int max_dirents_in_block = (BLOCK_SIZE / sizeof(dirent_t));  // max num of dirents in a block (that fit evenly)
-            int last = (max_dirents_in_block * sizeof(dirent_t));        // once j == last, it would have read all the dirents of the block
-            int j = 0;
-            while (j <= last) {
-                // check each directory entry (dirent) for the valid (data) block:
-                memset(&temp_dirent, 0, sizeof(dirent_t));
-                memcpy(&temp_dirent, buff_mem + j, sizeof(dirent_t));
-
-                if (temp_dirent.len == name_len) {
-                    if (strcmp(fname, temp_dirent.name) == 0) {
-                        // if the name matches, then copy directory entry to dirent structure
-
-                        *dirent = temp_dirent;
-                        return EXIT_SUCCESS;
-                    }
-                }
+        pthread_mutex_lock(&group->lock);
+        int blk = alloc_from_group(group, (has_goal && n == 0) ? data_bit(goal) : -1, want, got);
+        pthread_mutex_unlock(&group->lock);
 
-                // increment to the next dirent
-                j += sizeof(dirent_t);
-            }
+        if (blk != -1) {
+            return data_blkno(blk);
         }
     }
 
-    // return EXIT_FAILURE to indicate no matching exists
-    return EXIT_FAILURE;
+    return -1;
 }
 
-int dir_add(struct inode dir_inode, uint16_t f_ino, const char *fname, size_t name_len) {
-    /*
-            1. check to see if the dirent we want to add already exists
-            2a. if it does not, try to add the dirent to the directory's current data blocks
-            2b. if there is no room in the directory's current data blocks, allocate another data block
-            and put the new dirent there (if possible --> because all direct pointers may be in use, in this case throw error?)
-    */
-
-    // test printing data blocks of the directory inode:
+/*
+ * number of data blocks neither allocated nor reserved for pending data
+ */
+static int unreserved_blocks() {
+    int free_blocks = 0;
+    for (int i = 0; i < num_d_groups; i++) {
+        free_blocks += __atomic_load_n(&d_groups[i].free, __ATOMIC_RELAXED);
+    }
+    return free_blocks - __atomic_load_n(&delalloc_blocks, __ATOMIC_RELAXED);
+}
 
-    for (int i = 0; i < 16; i++) {
+/*
+ * Get available data block number (a run of one, as near the goal block as there is room),
+ * leaving the blocks reserved for pending data alone
+ */
+int get_avail_blkno(int goal) {
+    if (unreserved_blocks() <= 0) {
+        return -1;
     }
 
-    // Step 1: Read dir_inode's data block and check each directory entry of dir_inode to see if target already exists
-    for (int i = 0; i < 16; i++) {
-        // if the direct pointer points to a valid data block check its dirents
-        if (dir_inode.direct_ptr[i] >= data_block_start) {
-            // read the data block pointed to by direct_ptr[i] into buff_mem
-            memset(buff_mem, 0, BUFF_MEM_SIZE);
-            int read_ret_stat = bio_read(dir_inode.direct_ptr[i], buff_mem);
-            if (read_ret_stat < 0) {
-                return EXIT_FAILURE;
-            }
+    int got;
+    return alloc_blocks(goal, 1, &got);
+}
 
-            dirent_t temp_dirent;
-            int max_dirents_in_block = (BLOCK_SIZE / sizeof(dirent_t));  // max num of dirents in a block (that fit evenly)
-            int last = (max_dirents_in_block * sizeof(dirent_t));        // once j == last, it would have read all the dirents of the block
-            int j = 0;
+// the first data block of the block group an inode is in (the goal for a file's first block)
+static int inode_data_goal(int ino) {
+    return group_blkno(ino_group(ino), data_block_start);
+}
 
-            // traverse the dirents in this data block
-            while (j != last) {
-                // check each directory entry (dirent) for the valid (data) block:
-                memset(&temp_dirent, 0, sizeof(dirent_t));
-                memcpy(&temp_dirent, buff_mem + j, sizeof(dirent_t));
+/*
+ * Read both bitmaps of every block group into memory (once, at mount)
+ */
+static int load_bitmaps() {
+    int ngroups = superblock.groups;
+    int blocks[2 * MAX_GROUPS];
+    for (int g = 0; g < ngroups; g++) {
+        blocks[2 * g] = group_blkno(g, i_bitmap_index);
+        blocks[(2 * g) + 1] = group_blkno(g, d_bitmap_index);
+    }
+    cache_prefetch(blocks, 2 * ngroups);
 
-                // Step 2: Check if fname (directory name) is already used in other entries
-                // if the dirent we'd like to add already exists return EXIT_FAILURE
-                if (strcmp(temp_dirent.name, fname) == 0 && temp_dirent.ino == f_ino && temp_dirent.len == name_len) {
-                    return EXIT_FAILURE;
-                }
+    for (int g = 0; g < ngroups; g++) {
+        const char *i_block = cache_get(group_blkno(g, i_bitmap_index));
+        if (i_block == NULL) {
+            return EXIT_FAILURE;
+        }
+        memcpy((char *)i_bitmap + (g * superblock.inodes_per_group / 8), i_block, superblock.inodes_per_group / 8);
+        cache_put(group_blkno(g, i_bitmap_index));
 
-                // increment to the next dirent
-                j += sizeof(dirent_t);
-            }
+        const char *d_block = cache_get(group_blkno(g, d_bitmap_index));
+        if (d_block == NULL) {
+            return EXIT_FAILURE;
         }
+        memcpy((char *)d_bitmap + (g * superblock.data_per_group / 8), d_block, superblock.data_per_group / 8);
+        cache_put(group_blkno(g, d_bitmap_index));
     }
 
-    // at this point, we know the dirent we'd like to add does not exist in the current directory, so -->
+    return EXIT_SUCCESS;
+}
 
-    /*
-            - Step 3: Add directory entry in dir_inode's data block and write to disk
-                    - traverse the data blocks
-                    - find one that has enough space to hold another dirent
-                    -
-    */
+/*
+ * Write a group's slice of a bitmap back to its bitmap block if it changed (group lock held)
+ */
+static int sync_group_bitmap(alloc_group_t *group, const uint64_t *bitmap, int g, int group0_blk, char *bitmap_block) {
+    if (!group->dirty) {
+        return EXIT_SUCCESS;
+    }
 
-    dirent_t res_dirent = {
-        .ino = f_ino,
-        .valid = 1,
-        .len = name_len};
-    strcpy(res_dirent.name, fname);
-
-    // if the directory's data blocks are full of dirents and we cant add another --> throw error
-    if (dir_inode.size != MAX_DIRENTS) {
-        int dir_inode_block_num = inode_table_index + (dir_inode.ino / inodes_in_block);
-        int offset_in_block = (dir_inode.ino % inodes_in_block);
-
-        // traverse the data blocks of the dir_inode/current directory
-        for (int i = 0; i < 16; i++) {
-            // if the data block is valid
-            if (dir_inode.direct_ptr[i] >= data_block_start) {
-                // read the data block pointed to by direct_ptr[i] into buff_mem
-                memset(buff_mem, 0, BUFF_MEM_SIZE);
-                int read_ret_stat = bio_read(dir_inode.direct_ptr[i], buff_mem);
-                if (read_ret_stat < 0) {
-                    // free(dir_inode_block);
-                    return EXIT_FAILURE;
-                }
+    memset(bitmap_block, 0, BLOCK_SIZE);
+    memcpy(bitmap_block, bitmap + (group->first / 64), (group->nbits + 7) / 8);
+    if (cache_write(group_blkno(g, group0_blk), bitmap_block) < 0) {
+        return EXIT_FAILURE;
+    }
+    group->dirty = 0;
+    return EXIT_SUCCESS;
+}
 
-                dirent_t temp_dirent;
-                int max_dirents_in_block = (BLOCK_SIZE / sizeof(dirent_t));  // max num of dirents in a block (that fit evenly)
-                int last = (max_dirents_in_block * sizeof(dirent_t));        // once j == last, it would have read all the dirents of the block
-                int j = 0;
-
-                // traverse the dirent positions in this data block and check if there is an opening
-                while (j != last) {
-                    // check each directory entry (dirent) for the block:
-                    memset(&temp_dirent, 0, sizeof(dirent_t));
-                    memcpy(&temp_dirent, buff_mem + j, sizeof(dirent_t));
-                    // temp_dirent = (buff_mem + j);
-
-                    // if the dirent we are reading is empty we have found somewhere to put the new dirent
-                    if (temp_dirent.ino == 0) {
-                        // if (temp_dirent == NULL) {
-
-                        // if there is an open spot here within the data block, place the dirent here:
-                        memcpy(buff_mem + j, &res_dirent, sizeof(dirent_t));
-
-                        // write dirent to disk (write data block back to memory)
-                        int write_ret_stat = bio_write(dir_inode.direct_ptr[i], buff_mem);
-                        if (write_ret_stat < 0) {
-                            // free(dir_inode_block);
-                            return EXIT_FAILURE;
-                        }
-
-                        // update directory inode
-                        dir_inode.size += sizeof(dirent_t);
-                        dir_inode.link += 1;  // i think so
-                        dir_inode.vstat.st_atime = time(NULL);
-                        dir_inode.vstat.st_nlink += 1;
-
-                        memset(buff_mem, 0, BUFF_MEM_SIZE);
-                        int read_ret_stat = bio_read(dir_inode_block_num, buff_mem);
-                        if (read_ret_stat < 0) {
-                            return EXIT_FAILURE;
-                        }
-
-                        // save the updated current directory inode into the directory inode block
-                        memcpy(buff_mem + (offset_in_block * sizeof(dirent_t)), &dir_inode, sizeof(dirent_t));
-
-                        // write the updated dir_inode back to disk (I believe)
-                        write_ret_stat = bio_write(dir_inode_block_num, buff_mem);
-                        if (write_ret_stat < 0) {
-                            // free(dir_inode_block);
-                            return EXIT_FAILURE;
-                        }
-
-                        memset(buff_mem, 0, BUFF_MEM_SIZE);
-
-                        writei(dir_inode.ino, &dir_inode);
-
-                        return EXIT_SUCCESS;
-                    }
-
-                    // increment to the next dirent
-                    j += sizeof(dirent_t);
-                }
-            }
+/*
+ * Write the superblock back to its block if inode chunks were added since it last was
+ */
+static int sync_superblock() {
+    int ret_stat = EXIT_SUCCESS;
+    pthread_mutex_lock(&superblock_lock);
+    if (superblock_dirty) {
+        char *sb_block = bio_alloc(BLOCK_SIZE);
+        if (sb_block == NULL) {
+            pthread_mutex_unlock(&superblock_lock);
+            return EXIT_FAILURE;
         }
+        memset(sb_block, 0, BLOCK_SIZE);
+        memcpy(sb_block, &superblock, sizeof(superblock_t));
+        if (cache_write(superblock_index, sb_block) < 0) {
+            ret_stat = EXIT_FAILURE;
+        } else {
+            superblock_dirty = 0;
+        }
+        free(sb_block);
+    }
+    pthread_mutex_unlock(&superblock_lock);
 
-        /*
-                if we get to here after the above, then there wasn't any free spots within the already allocated
-                data blocks of the directory, so try to add another datablock to the directory
-        */
-
-        // traverse the direct pointers of the dir_inode
-        for (int i = 0; i < 16; i++) {
-            // if there is an opening to put another data block, allocate, update, and save
-            if (dir_inode.direct_ptr[i] == 0) {
-                // find the next available block
-                int avail_d_block = get_avail_blkno();
-                if (avail_d_block == -1) {
-                    perror("********** dir_add() Couldn't find open data block");
-                    // free(dir_inode_block);
-                    return EXIT_FAILURE;
-                }
-
-                dir_inode.direct_ptr[i] = avail_d_block;
-
-                // read the new data block from disk
-                memset(buff_mem, 0, BUFF_MEM_SIZE);
-                int read_ret_stat = bio_read(dir_inode.direct_ptr[i], buff_mem);
-                if (read_ret_stat < 0) {
-                    // free(dir_inode_block);
-                    return EXIT_FAILURE;
-                }
+    return ret_stat;
+}
 
-                // put the dirent into the new data block
-                memcpy(buff_mem, &res_dirent, sizeof(dirent_t));
+/*
+ * Write whichever groups' bitmaps changed since the last sync back to their blocks,
+ * and the superblock's inode chunk map with them
+ */
+static int sync_bitmaps() {
+    int ret_stat = sync_superblock();
+    char *bitmap_block = bio_alloc(BLOCK_SIZE);
+    if (bitmap_block == NULL) {
+        return EXIT_FAILURE;
+    }
 
-                // write the new and updated data block back to disk
-                int write_ret_stat = bio_write(dir_inode.direct_ptr[i], buff_mem);
+    for (int g = 0; g < num_i_groups; g++) {
+        pthread_mutex_lock(&i_groups[g].lock);
+        if (sync_group_bitmap(&i_groups[g], i_bitmap, g, i_bitmap_index, bitmap_block) != EXIT_SUCCESS) {
+            ret_stat = EXIT_FAILURE;
+        }
+        pthread_mutex_unlock(&i_groups[g].lock);
+    }
+    for (int g = 0; g < num_d_groups; g++) {
+        pthread_mutex_lock(&d_groups[g].lock);
+        if (sync_group_bitmap(&d_groups[g], d_bitmap, g, d_bitmap_index, bitmap_block) != EXIT_SUCCESS) {
+            ret_stat = EXIT_FAILURE;
+        }
+        pthread_mutex_unlock(&d_groups[g].lock);
+    }
 
-                dirent_t *test_dirent = (dirent_t *)buff_mem;
+    free(bitmap_block);
+    return ret_stat;
+}
 
-                if (write_ret_stat < 0) {
-                    // free(dir_inode_block);
-                    return EXIT_FAILURE;
-                }
+static int compare_int(const void *a, const void *b) {
+    int x = *(const int *)a;
+    int y = *(const int *)b;
+    return (x > y) - (x < y);
+}
 
-                // update the current directory inode
-                dir_inode.size += sizeof(dirent_t);
-                dir_inode.link += 1;  // i think so
-                dir_inode.vstat.st_atime = time(NULL);
-                dir_inode.vstat.st_nlink += 1;
+/*
+ * Give the host storage behind the freed data blocks back, in one go:
+ * each run of consecutive freed blocks becomes a single hole in the disk file.
+ * Blocks that were handed out again since they were freed are left alone.
+ * (punch_lock held)
+ */
+static void punch_queued_blocks() {
+    qsort(punch_list, punch_count, sizeof(int), compare_int);
+
+    // the queued blocks' groups are locked one at a time (the list is sorted, so each
+    // group's blocks are together), so none of them can be handed out again meanwhile
+    alloc_group_t *locked = NULL;
+    int run_start = -1;
+    int run_len = 0;
+    for (int i = 0; i < punch_count; i++) {
+        int blkno = punch_list[i];
+        alloc_group_t *group = &d_groups[data_bit(blkno) / superblock.data_per_group];
+        if (group != locked) {
+            bio_discard(run_start, run_len);
+            run_start = -1;
+            run_len = 0;
+            if (locked != NULL) {
+                pthread_mutex_unlock(&locked->lock);
+            }
+            pthread_mutex_lock(&group->lock);
+            locked = group;
+        }
 
-                memset(buff_mem, 0, BUFF_MEM_SIZE);
-                read_ret_stat = bio_read(dir_inode_block_num, buff_mem);
-                if (read_ret_stat < 0) {
-                    return EXIT_FAILURE;
-                }
+        if (get_bitmap((bitmap_t)d_bitmap, data_bit(blkno)) != 0 || (run_start >= 0 && blkno < run_start + run_len)) {
+            continue;  // in use again, or already queued
+        }
 
-                // save the updated current directory inode into the directory inode block
-                memcpy(buff_mem + (offset_in_block * sizeof(dirent_t)), &dir_inode, sizeof(dirent_t));
+        // the freed block's contents must not be written back over the hole later
+        cache_discard(blkno);
 
-                for (int k = 0; k <= dir_inode.ino; k++) {
-                    dirent_t *temp = buff_mem + k * sizeof(dirent_t);
-                }
+        if (run_start >= 0 && blkno == run_start + run_len) {
+            run_len++;
+            continue;
+        }
+        bio_discard(run_start, run_len);
+        run_start = blkno;
+        run_len = 1;
+    }
+    bio_discard(run_start, run_len);
+    if (locked != NULL) {
+        pthread_mutex_unlock(&locked->lock);
+    }
 
-                // write the updated dir_inode block back to disk
-                write_ret_stat = bio_write(dir_inode_block_num, buff_mem);
-                if (write_ret_stat < 0) {
-                    // free(dir_inode_block);
-                    return EXIT_FAILURE;
-                }
-                // update the inode in the inode directory that stores all the inodes
-                writei(dir_inode.ino, &dir_inode);
+    punch_count = 0;
+}
 
-                // free(dir_inode_block);
-                return EXIT_SUCCESS;
-            }
-        }
+static int punch_freed_blocks() {
+    pthread_mutex_lock(&punch_lock);
+    if (punch_count > 0) {
+        punch_queued_blocks();
+    }
+    pthread_mutex_unlock(&punch_lock);
+    return EXIT_SUCCESS;
+}
 
-    } else {
-        perror("Directory is full, can't add another directory entry");
+/*
+ * Free a data block: clear its bit in the data block bitmap, and queue it
+ * so that the next punch_freed_blocks() returns its storage to the host
+ */
+int release_blkno(int blkno) {
+    if (!is_data_blkno(blkno)) {
         return EXIT_FAILURE;
     }
+    int bit = data_bit(blkno);
+    alloc_group_t *group = &d_groups[bit / superblock.data_per_group];
+
+    pthread_mutex_lock(&group->lock);
+    unset_bitmap((bitmap_t)d_bitmap, bit);
+    group->dirty = 1;
+    give_to_extents(group, bit);
+    pthread_mutex_unlock(&group->lock);
+
+    pthread_mutex_lock(&punch_lock);
+    if (punch_count == PUNCH_BATCH) {
+        punch_queued_blocks();
+    }
+    punch_list[punch_count++] = blkno;
+    pthread_mutex_unlock(&punch_lock);
+
+    return EXIT_SUCCESS;
 }
 
-int dir_remove(struct inode dir_inode, const char *fname, size_t name_len) {
-    
-    printf("***********dir_remove() START\n");
+/*
+ * Free an inode number: clear its bit in the inode bitmap
+ */
+int release_ino(int ino) {
+    alloc_group_t *group = &i_groups[ino_group(ino)];
 
-    // Read dir_inode's data block and checks each directory entry of dir_inode
-    int inode_block_num = inode_table_index + (dir_inode.ino / inodes_in_block);
-    int offset_in_block = (dir_inode.ino % inodes_in_block);
-    dirent_t temp_dirent;
+    pthread_mutex_lock(&group->lock);
+    unset_bitmap((bitmap_t)i_bitmap, ino);
+    __atomic_add_fetch(&group->free, 1, __ATOMIC_RELAXED);
+    group->dirty = 1;
+    pthread_mutex_unlock(&group->lock);
 
-    for (int i = 0; i < NUM_DIRECT_PTRS; i++) {
+    return EXIT_SUCCESS;
+}
 
-        int data_block = dir_inode.direct_ptr[i];
-        if (data_block >= data_block_start) {
+/*
+ * Give chunk c of group g's inode table its blocks: a run of them from the group's data
+ * blocks, zeroed so all its inodes start out invalid (group g's inode lock held, so
+ * a chunk only gets them once). The superblock's chunk map goes to disk with the bitmaps.
+ */
+static int alloc_inode_chunk(int g, int c) {
+    int chunk_blocks = INODES_PER_CHUNK / inodes_in_block;
+    if (unreserved_blocks() < chunk_blocks) {
+        return EXIT_FAILURE;
+    }
 
-            printf("***********dir_remove() found valid data block: %d\n", data_block);
+    int got;
+    int first = alloc_blocks(group_blkno(g, data_block_start), chunk_blocks, &got);
+    if (first == -1) {
+        return EXIT_FAILURE;
+    }
+    if (got < chunk_blocks) {
+        for (int i = 0; i < got; i++) {
+            release_blkno(first + i);
+        }
+        return EXIT_FAILURE;
+    }
 
-            memset(buff_mem, 0, BUFF_MEM_SIZE);
-            if (bio_read(data_block, buff_mem) < 0) {
-                return -EXIT_FAILURE;
-            }
+    char *zeros = bio_alloc(BLOCK_SIZE);
+    if (zeros == NULL) {
+        return EXIT_FAILURE;
+    }
+    memset(zeros, 0, BLOCK_SIZE);
+    for (int i = 0; i < chunk_blocks; i++) {
+        if (cache_write(first + i, zeros) < 0) {
+            free(zeros);
+            return EXIT_FAILURE;
+        }
+    }
+    free(zeros);
 
-            printf("***********dir_remove() read valid data block into buff_mem\n");
+    pthread_mutex_lock(&superblock_lock);
+    __atomic_store_n(&superblock.inode_chunks[g][c], first, __ATOMIC_RELEASE);
+    superblock_dirty = 1;
+    pthread_mutex_unlock(&superblock_lock);
 
-            // (same traversal method as in dir_find())
-            int max_dirents_in_block = (BLOCK_SIZE / sizeof(dirent_t));  
-            int last = (max_dirents_in_block * sizeof(dirent_t)); 
-            int j = 0;
-            while (j <= last) {
+    return EXIT_SUCCESS;
+}
 
-                // copy the dirent at position j in the buffer (which holds the data block), to temp_dirent
-                memset(&temp_dirent, 0, sizeof(dirent_t));
-                memcpy(&temp_dirent, buff_mem + j, sizeof(dirent_t));
+/*
+ * Get available inode number from bitmap, in block group goal_group if it has one left
+ * (goal_group -1: in this thread's group), giving its chunk of the inode table blocks
+ * if it is the chunk's first
+    returns -1 to indicate failure, else returns the inode position found that was available
+ */
+int get_avail_ino(int goal_group) {
+    // Step 1: Search the (resident) inode bitmap slice of the goal group first,
+    // then the other groups' slices
+    int start = (goal_group >= 0 && goal_group < num_i_groups) ? goal_group : thread_group(num_i_groups);
+    for (int n = 0; n < num_i_groups; n++) {
+        int g = (start + n) % num_i_groups;
+        alloc_group_t *group = &i_groups[g];
+        if (__atomic_load_n(&group->free, __ATOMIC_RELAXED) == 0) {
+            continue;
+        }
+
+        pthread_mutex_lock(&group->lock);
+        int i = find_free_bit(i_bitmap + (group->first / 64), group->nbits, &group->hint);
+
+        // Step 2: Make sure its chunk of the inode table has blocks
+        if (i != -1 && superblock.inode_chunks[g][i / INODES_PER_CHUNK] == 0 &&
+            alloc_inode_chunk(g, i / INODES_PER_CHUNK) != EXIT_SUCCESS) {
+            unset_bitmap((bitmap_t)i_bitmap, group->first + i);
+            group->hint = i;
+            i = -1;
+        }
+
+        // Step 3: Mark it dirty, it is written to disk on the next flush
+        if (i != -1) {
+            __atomic_sub_fetch(&group->free, 1, __ATOMIC_RELAXED);
+            group->dirty = 1;
+        }
+        pthread_mutex_unlock(&group->lock);
+
+        if (i != -1) {
+            return group->first + i;
+        }
+    }
+
+    return -1;
+}
+
+/*
+ * In-memory inode cache: inodes are looked up by number in a hash table, and kept in
+ * LRU order for eviction. readi() and writei() copy in and out of it, so looking an inode
+ * up again costs no block I/O, and writei() only marks it dirty. The dirty inodes are
+ * written back by icache_flush(), all the dirty inodes of one inode table block with a
+ * single write of that block. An entry with references (iget()) is never evicted.
+ */
+#define ICACHE_ENTRIES 1024
+#define ICACHE_BUCKETS 1024
+
+typedef struct icache_entry {
+    int ino;                               // -1: unused
+    int refs;                              // iget()s not yet iput()
+    int dirty;                             // changed since it was last written back
+    inode_t inode;
+    struct icache_entry *hnext;            // hash chain
+    struct icache_entry *prev, *next;      // LRU list, most recently used first
+} icache_entry_t;
+
+static icache_entry_t icache[ICACHE_ENTRIES];
+static icache_entry_t *icache_hash[ICACHE_BUCKETS];
+static icache_entry_t *icache_head = NULL;
+static icache_entry_t *icache_tail = NULL;
+static pthread_mutex_t icache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void icache_lru_unlink(icache_entry_t *e) {
+    if (e->prev != NULL) {
+        e->prev->next = e->next;
+    } else {
+        icache_head = e->next;
+    }
+    if (e->next != NULL) {
+        e->next->prev = e->prev;
+    } else {
+        icache_tail = e->prev;
+    }
+    e->prev = e->next = NULL;
+}
+
+static void icache_lru_push(icache_entry_t *e) {
+    e->prev = NULL;
+    e->next = icache_head;
+    if (icache_head != NULL) {
+        icache_head->prev = e;
+    }
+    icache_head = e;
+    if (icache_tail == NULL) {
+        icache_tail = e;
+    }
+}
+
+static icache_entry_t *icache_lookup(int ino) {
+    for (icache_entry_t *e = icache_hash[ino % ICACHE_BUCKETS]; e != NULL; e = e->hnext) {
+        if (e->ino == ino) {
+            return e;
+        }
+    }
+    return NULL;
+}
+
+static void icache_hash_remove(icache_entry_t *e) {
+    icache_entry_t **p = &icache_hash[e->ino % ICACHE_BUCKETS];
+    while (*p != e) {
+        p = &(*p)->hnext;
+    }
+    *p = e->hnext;
+    e->hnext = NULL;
+}
+
+static void icache_init() {
+    memset(icache_hash, 0, sizeof(icache_hash));
+    icache_head = icache_tail = NULL;
+    for (int i = 0; i < ICACHE_ENTRIES; i++) {
+        icache[i].ino = -1;
+        icache[i].refs = 0;
+        icache[i].dirty = 0;
+        icache[i].hnext = NULL;
+        icache_lru_push(&icache[i]);
+    }
+}
+
+/*
+ * Write the dirty cached inodes of the inode table block holding an inode into that block
+ * (icache_lock held), the block itself goes to disk with the next cache_flush()
+ */
+static int icache_write_block(int ino) {
+    int inode_block_num = inode_blkno(ino);
+    if (inode_block_num == -1) {
+        return EXIT_FAILURE;
+    }
+    char *inode_block = bio_alloc(BLOCK_SIZE);
+    if (inode_block == NULL) {
+        return EXIT_FAILURE;
+    }
+    if (cache_read(inode_block_num, inode_block) < 0) {
+        free(inode_block);
+        return EXIT_FAILURE;
+    }
+
+    // the inodes of a block are consecutive numbers (see inode_blkno())
+    int first_ino = ino - (ino % inodes_in_block);
+    for (ino = first_ino; ino < first_ino + inodes_in_block; ino++) {
+        icache_entry_t *e = icache_lookup(ino);
+        if (e != NULL && e->dirty) {
+            memcpy(inode_block + ((ino % inodes_in_block) * sizeof(inode_t)), &e->inode, sizeof(inode_t));
+        }
+    }
+
+    int ret_stat = (cache_write(inode_block_num, inode_block) < 0) ? EXIT_FAILURE : EXIT_SUCCESS;
+    for (ino = first_ino; ino < first_ino + inodes_in_block && ret_stat == EXIT_SUCCESS; ino++) {
+        icache_entry_t *e = icache_lookup(ino);
+        if (e != NULL) {
+            e->dirty = 0;
+        }
+    }
+
+    free(inode_block);
+    return ret_stat;
+}
+
+/*
+ * Find an inode in the cache, or load it into the least recently used entry that isn't
+ * referenced (icache_lock held). returns NULL if every entry is referenced or the read fails
+ */
+static icache_entry_t *icache_fetch(int ino) {
+    icache_entry_t *e = icache_lookup(ino);
+    if (e != NULL) {
+        icache_lru_unlink(e);
+        icache_lru_push(e);
+        return e;
+    }
+
+    for (e = icache_tail; e != NULL && e->refs > 0; e = e->prev) {
+    }
+    if (e == NULL) {
+        return NULL;
+    }
+
+    // the victim's block gets all its dirty neighbours written with it
+    if (e->ino != -1 && e->dirty && icache_write_block(e->ino) != EXIT_SUCCESS) {
+        return NULL;
+    }
+    if (e->ino != -1) {
+        icache_hash_remove(e);
+        e->ino = -1;
+    }
+
+    // (an inode whose chunk has no blocks was never allocated)
+    int inode_block_num = inode_blkno(ino);
+    if (inode_block_num == -1) {
+        return NULL;
+    }
+    const char *inode_block = cache_get(inode_block_num);
+    if (inode_block == NULL) {
+        return NULL;
+    }
+    memcpy(&e->inode, inode_block + ((ino % inodes_in_block) * sizeof(inode_t)), sizeof(inode_t));
+    cache_put(inode_block_num);
+
+    e->ino = ino;
+    e->dirty = 0;
+    e->hnext = icache_hash[ino % ICACHE_BUCKETS];
+    icache_hash[ino % ICACHE_BUCKETS] = e;
+    icache_lru_unlink(e);
+    icache_lru_push(e);
+    return e;
+}
+
+/*
+ * Take a reference to an inode in the cache: it stays cached (at the address returned)
+ * until the matching iput(). Changes made through it have to be marked with writei().
+ */
+inode_t *iget(int ino) {
+    pthread_mutex_lock(&icache_lock);
+    icache_entry_t *e = icache_fetch(ino);
+    if (e != NULL) {
+        e->refs++;
+    }
+    pthread_mutex_unlock(&icache_lock);
+
+    return (e != NULL) ? &e->inode : NULL;
+}
+
+void iput(inode_t *inode) {
+    icache_entry_t *e = (icache_entry_t *)((char *)inode - offsetof(icache_entry_t, inode));
+
+    pthread_mutex_lock(&icache_lock);
+    e->refs--;
+    pthread_mutex_unlock(&icache_lock);
+}
+
+/*
+ * Write every dirty cached inode back into the inode table (sorted, so each inode
+ * table block is written once, whatever number of its inodes changed)
+ */
+static int icache_flush() {
+    int ret_stat = EXIT_SUCCESS;
+    int dirty[ICACHE_ENTRIES];
+    int ndirty = 0;
+
+    pthread_mutex_lock(&icache_lock);
+    for (int i = 0; i < ICACHE_ENTRIES; i++) {
+        if (icache[i].ino != -1 && icache[i].dirty) {
+            dirty[ndirty++] = icache[i].ino;
+        }
+    }
+    qsort(dirty, ndirty, sizeof(int), compare_int);
+
+    int last_block = -1;
+    for (int i = 0; i < ndirty; i++) {
+        int inode_block_num = inode_blkno(dirty[i]);
+        if (inode_block_num != last_block && icache_write_block(dirty[i]) != EXIT_SUCCESS) {
+            ret_stat = EXIT_FAILURE;
+        }
+        last_block = inode_block_num;
+    }
+    pthread_mutex_unlock(&icache_lock);
+
+    return ret_stat;
+}
+
+/*
+ * inode operations:
+ * given an inode number, return that inode (from the inode cache, or else from disk)
+ */
+int readi(uint32_t ino, struct inode *inode) {
+    // Step 1: Find the inode in the inode cache, reading its block of the inode table on a miss
+    pthread_mutex_lock(&icache_lock);
+    icache_entry_t *e = icache_fetch(ino);
+
+    // Step 2: Copy the inode out of the cache
+    if (e != NULL) {
+        memcpy(inode, &e->inode, sizeof(inode_t));
+    }
+    pthread_mutex_unlock(&icache_lock);
+
+    return (e != NULL) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+int writei(uint32_t ino, struct inode *inode) {
+    // Step 1: Find the inode's entry in the inode cache
+    pthread_mutex_lock(&icache_lock);
+    icache_entry_t *e = icache_fetch(ino);
+
+    // Step 2: Update it there and mark it dirty, it is written to disk by icache_flush()
+    if (e != NULL && &e->inode != inode) {
+        memcpy(&e->inode, inode, sizeof(inode_t));
+    }
+    if (e != NULL) {
+        e->dirty = 1;
+    }
+    pthread_mutex_unlock(&icache_lock);
+
+    return (e != NULL) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+/*
+ * Block mapping: which data block holds each block of a file. An INODE_EXTENTS inode maps
+ * them with an extent tree rooted in the inode (see rufs.h), so a lookup costs a binary
+ * search per level, and a file laid out contiguously needs one record per run of blocks.
+ * Any other inode maps them with direct and indirect pointers, one block each (on disks
+ * made with -o blockmap). bmap_generation changes with every change to any file's mapping.
+ */
+#define EXTENTS_IN_BLOCK ((BLOCK_SIZE - sizeof(extent_header_t)) / sizeof(extent_rec_t))
+#define MAX_FILE_BLOCKS (UINT32_MAX / BLOCK_SIZE)  // so the size of any file fits in inode_t.size
+#define PREFETCH_BATCH 64
+
+static unsigned long bmap_generation = 0;
+
+/*
+ * Direct and indirect pointers (inodes without INODE_EXTENTS): the first NUM_DIRECT_PTRS
+ * blocks of a file are in direct_ptr, the next PTRS_PER_BLOCK are in the pointer block
+ * indirect_ptr[0] points to, and the rest in the pointer blocks that indirect_ptr[1]'s
+ * block points to. Pointer blocks are only allocated once something is mapped through them.
+ */
+#define PTRS_PER_BLOCK ((int)(BLOCK_SIZE / sizeof(int)))
+#define SINGLE_START NUM_DIRECT_PTRS                     // first block mapped through indirect_ptr[0]
+#define DOUBLE_START (NUM_DIRECT_PTRS + PTRS_PER_BLOCK)  // first block mapped through indirect_ptr[1]
+
+/*
+ * Entry idx of pointer block blkno (0: a hole, -1: the block can't be read), and in
+ * *run how many entries from there on point to the blocks following it
+ */
+static int ind_lookup(int blkno, int idx, int *run) {
+    const int *ptrs = cache_get(blkno);
+    if (ptrs == NULL) {
+        *run = 0;
+        return -1;
+    }
+
+    int pblk = ptrs[idx];
+    int len = 0;
+    if (pblk >= data_block_start) {
+        for (len = 1; idx + len < PTRS_PER_BLOCK && ptrs[idx + len] == pblk + len; len++) {
+        }
+    } else {
+        pblk = 0;
+    }
+    cache_put(blkno);
+
+    *run = len;
+    return pblk;
+}
+
+static int blockmap_lookup(const inode_t *inode, int lblk, int *run) {
+    *run = 0;
+    if (lblk < NUM_DIRECT_PTRS) {
+        int pblk = inode->direct_ptr[lblk];
+        if (pblk < data_block_start) {
+            return 0;
+        }
+        for (*run = 1; lblk + *run < NUM_DIRECT_PTRS && inode->direct_ptr[lblk + *run] == pblk + *run; (*run)++) {
+        }
+        return pblk;
+    }
+
+    if (lblk < DOUBLE_START) {
+        if (inode->indirect_ptr[0] < data_block_start) {
+            return 0;
+        }
+        return ind_lookup(inode->indirect_ptr[0], lblk - SINGLE_START, run);
+    }
+
+    int rel = lblk - DOUBLE_START;
+    if (inode->indirect_ptr[1] < data_block_start) {
+        return 0;
+    }
+    int ptr_blkno = ind_lookup(inode->indirect_ptr[1], rel / PTRS_PER_BLOCK, run);
+    if (ptr_blkno <= 0) {
+        *run = 0;
+        return ptr_blkno;
+    }
+    return ind_lookup(ptr_blkno, rel % PTRS_PER_BLOCK, run);
+}
+
+/*
+ * The pointer block *slot points to, or a new (zeroed) one it is set to point to if there
+ * is none yet, in which case *dirty is set (for a slot in a pointer block to be written back)
+ */
+static int ind_get(inode_t *inode, int *slot, int *dirty) {
+    if (*slot >= data_block_start) {
+        return *slot;
+    }
+
+    int blkno = get_avail_blkno(inode_data_goal(inode->ino));
+    if (blkno == -1) {
+        return -1;
+    }
+    char *zeros = calloc(1, BLOCK_SIZE);
+    if (zeros == NULL || cache_write(blkno, zeros) < 0) {
+        free(zeros);
+        release_blkno(blkno);
+        return -1;
+    }
+    free(zeros);
+
+    *slot = blkno;
+    *dirty = 1;
+    return blkno;
+}
+
+static int blockmap_insert(inode_t *inode, int lblk, int pblk, int count) {
+    int *ptrs = malloc(BLOCK_SIZE);
+    int *dbl_ptrs = malloc(BLOCK_SIZE);
+    int ret_stat = (ptrs != NULL && dbl_ptrs != NULL) ? EXIT_SUCCESS : EXIT_FAILURE;
+
+    while (count > 0 && ret_stat == EXIT_SUCCESS) {
+        if (lblk < NUM_DIRECT_PTRS) {
+            inode->direct_ptr[lblk++] = pblk++;
+            count--;
+            continue;
+        }
+
+        // the pointer block with lblk's entry, where that is in it, and then as many of
+        // the new blocks as that pointer block has entries for are filled in at once
+        int in_inode = 0;
+        int ptr_blkno;
+        int idx;
+        if (lblk < DOUBLE_START) {
+            ptr_blkno = ind_get(inode, &inode->indirect_ptr[0], &in_inode);
+            idx = lblk - SINGLE_START;
+        } else {
+            int rel = lblk - DOUBLE_START;
+            int dbl_blkno = ind_get(inode, &inode->indirect_ptr[1], &in_inode);
+            int dirty = 0;
+            ptr_blkno = -1;
+            if (dbl_blkno != -1 && cache_read(dbl_blkno, dbl_ptrs) >= 0) {
+                ptr_blkno = ind_get(inode, &dbl_ptrs[rel / PTRS_PER_BLOCK], &dirty);
+                if (dirty && cache_write(dbl_blkno, dbl_ptrs) < 0) {
+                    ptr_blkno = -1;
+                }
+            }
+            idx = rel % PTRS_PER_BLOCK;
+        }
+        if (ptr_blkno == -1 || cache_read(ptr_blkno, ptrs) < 0) {
+            ret_stat = EXIT_FAILURE;
+            break;
+        }
+
+        int n = (count < PTRS_PER_BLOCK - idx) ? count : PTRS_PER_BLOCK - idx;
+        for (int j = 0; j < n; j++) {
+            ptrs[idx + j] = pblk + j;
+        }
+        if (cache_write(ptr_blkno, ptrs) < 0) {
+            ret_stat = EXIT_FAILURE;
+        }
+        lblk += n;
+        pblk += n;
+        count -= n;
+    }
+
+    free(ptrs);
+    free(dbl_ptrs);
+    return ret_stat;
+}
+
+/*
+ * Free what pointer block blkno maps from its block from on (level 1: its entries are data
+ * blocks, level 2: they are level 1 pointer blocks, which go too once they map nothing).
+ * blkno itself is left to the caller.
+ */
+static int ind_truncate(int blkno, int level, int from) {
+    int span = (level == 1) ? 1 : PTRS_PER_BLOCK;  // blocks mapped through each entry
+    int *ptrs = malloc(BLOCK_SIZE);
+    if (ptrs == NULL || cache_read(blkno, ptrs) < 0) {
+        free(ptrs);
+        return EXIT_FAILURE;
+    }
+
+    int ret_stat = EXIT_SUCCESS;
+    if (level == 2 && from % span != 0 && ptrs[from / span] >= data_block_start) {
+        ret_stat = ind_truncate(ptrs[from / span], 1, from % span);
+    }
+    for (int i = (from + span - 1) / span; i < PTRS_PER_BLOCK && ret_stat == EXIT_SUCCESS; i++) {
+        if (ptrs[i] < data_block_start) {
+            continue;
+        }
+        if (level == 2) {
+            ret_stat = ind_truncate(ptrs[i], 1, 0);
+        }
+        if (ret_stat == EXIT_SUCCESS) {
+            ret_stat = release_blkno(ptrs[i]);
+        }
+        ptrs[i] = 0;
+    }
+
+    // (a block freed as a whole isn't worth writing back)
+    if (ret_stat == EXIT_SUCCESS && from > 0 && cache_write(blkno, ptrs) < 0) {
+        ret_stat = EXIT_FAILURE;
+    }
+    free(ptrs);
+    return ret_stat;
+}
+
+static int blockmap_truncate(inode_t *inode, int from) {
+    for (int i = from; i < NUM_DIRECT_PTRS; i++) {
+        if (inode->direct_ptr[i] >= data_block_start) {
+            if (release_blkno(inode->direct_ptr[i]) != EXIT_SUCCESS) {
+                return EXIT_FAILURE;
+            }
+            inode->direct_ptr[i] = 0;
+        }
+    }
+
+    int starts[NUM_INDIRECT_PTRS] = {SINGLE_START, DOUBLE_START};
+    for (int level = 1; level <= NUM_INDIRECT_PTRS; level++) {
+        int *slot = &inode->indirect_ptr[level - 1];
+        int start = starts[level - 1];
+        if (*slot < data_block_start || (level == 1 && from >= DOUBLE_START)) {
+            continue;
+        }
+
+        int rel = (from > start) ? from - start : 0;
+        if (ind_truncate(*slot, level, rel) != EXIT_SUCCESS) {
+            return EXIT_FAILURE;
+        }
+        if (rel == 0) {
+            if (release_blkno(*slot) != EXIT_SUCCESS) {
+                return EXIT_FAILURE;
+            }
+            *slot = 0;
+        }
+    }
+
+    return EXIT_SUCCESS;
+}
+
+
+static extent_rec_t *ext_recs(const extent_header_t *eh) {
+    return (extent_rec_t *)(eh + 1);
+}
+
+static void extent_init(inode_t *inode) {
+    memset(inode->inline_data, 0, INLINE_DATA_SIZE);
+    inode->flags |= INODE_EXTENTS;
+    inode->ext_header.magic = EXTENT_MAGIC;
+    inode->ext_header.max = EXTENTS_IN_INODE;
+}
+
+// a new file's (empty) block mapping, of the kind the disk was made with
+static void bmap_init(inode_t *inode) {
+    if (superblock.features & FEATURE_BLOCKMAP) {
+        memset(inode->inline_data, 0, INLINE_DATA_SIZE);
+        inode->flags &= ~INODE_EXTENTS;
+    } else {
+        extent_init(inode);
+    }
+}
+
+// the number of blocks a file can map
+static int bmap_max_blocks(const inode_t *inode) {
+    long max_blocks = DOUBLE_START + ((long)PTRS_PER_BLOCK * PTRS_PER_BLOCK);
+    if ((inode->flags & INODE_EXTENTS) || max_blocks > MAX_FILE_BLOCKS) {
+        max_blocks = MAX_FILE_BLOCKS;
+    }
+    return max_blocks;
+}
+
+// the last record of a node starting at or before lblk (or else its first one)
+static int ext_search(const extent_header_t *eh, uint32_t lblk) {
+    const extent_rec_t *recs = ext_recs(eh);
+    int lo = 0;
+    int hi = eh->entries - 1;
+    while (lo < hi) {
+        int mid = (lo + hi + 1) / 2;
+        if (recs[mid].lblk <= lblk) {
+            lo = mid;
+        } else {
+            hi = mid - 1;
+        }
+    }
+    return lo;
+}
+
+/*
+ * The data block holding logical block lblk of a file (0: a hole, -1: the mapping can't be read),
+ * and in *run (if not NULL) how many blocks from there on follow it on disk (0 for a hole)
+ */
+int bmap(const inode_t *inode, int lblk, int *run) {
+    int pblk = 0;
+    int len = 0;
+
+    if (!(inode->flags & INODE_EXTENTS)) {
+        pblk = blockmap_lookup(inode, lblk, &len);
+    } else {
+        // walk down from the root, with each node below it pinned in the block cache while it is looked at
+        const extent_header_t *eh = &inode->ext_header;
+        int node = -1;
+        while (eh->magic == EXTENT_MAGIC && eh->entries > 0) {
+            const extent_rec_t *rec = ext_recs(eh) + ext_search(eh, lblk);
+            if (eh->depth == 0) {
+                if (lblk >= rec->lblk && lblk < rec->lblk + rec->len) {
+                    pblk = rec->pblk + (lblk - rec->lblk);
+                    len = rec->len - (lblk - rec->lblk);
+                }
+                break;
+            }
+
+            int child = rec->pblk;
+            const char *child_block = cache_get(child);
+            if (node != -1) {
+                cache_put(node);
+            }
+            node = child;
+            if (child_block == NULL) {
+                return -1;
+            }
+            eh = (const extent_header_t *)child_block;
+        }
+        if (eh->magic != EXTENT_MAGIC) {
+            pblk = -1;
+        }
+        if (node != -1) {
+            cache_put(node);
+        }
+    }
+
+    if (run != NULL) {
+        *run = len;
+    }
+    return pblk;
+}
+
+/*
+ * Read the blocks mapped from logical block first to last into the block cache, in batches
+ */
+static void bmap_prefetch(const inode_t *inode, int first, int last) {
+    int blocks[PREFETCH_BATCH];
+    int n = 0;
+
+    for (int lblk = first; lblk <= last;) {
+        int run;
+        int pblk = bmap(inode, lblk, &run);
+        if (pblk <= 0) {
+            lblk++;
+            continue;
+        }
+        for (int j = 0; j < run && lblk <= last; j++, lblk++) {
+            blocks[n++] = pblk + j;
+            if (n == PREFETCH_BATCH) {
+                cache_prefetch(blocks, n);
+                n = 0;
+            }
+        }
+    }
+    if (n > 0) {
+        cache_prefetch(blocks, n);
+    }
+}
+
+/*
+ * Put record rec at position pos of node eh. A full node is split: the root (in the inode)
+ * moves into a new block one level down, any other node moves half its records (or,
+ * appending, just the new one) into a new block next to it, and the record the parent
+ * needs for that block is returned in *split, with 1. The caller writes eh back.
+ */
+static int ext_add_rec(inode_t *inode, extent_header_t *eh, int pos, const extent_rec_t *rec, extent_rec_t *split) {
+    extent_rec_t *recs = ext_recs(eh);
+    if (eh->entries < eh->max) {
+        memmove(&recs[pos + 1], &recs[pos], (eh->entries - pos) * sizeof(extent_rec_t));
+        recs[pos] = *rec;
+        eh->entries++;
+        return 0;
+    }
+
+    int new_blkno = get_avail_blkno(inode_data_goal(inode->ino));
+    if (new_blkno == -1) {
+        return -1;
+    }
+    char *new_block = calloc(1, BLOCK_SIZE);
+    if (new_block == NULL) {
+        release_blkno(new_blkno);
+        return -1;
+    }
+    extent_header_t *new_eh = (extent_header_t *)new_block;
+    new_eh->magic = EXTENT_MAGIC;
+    new_eh->max = EXTENTS_IN_BLOCK;
+    new_eh->depth = eh->depth;
+
+    int ret;
+    if (eh == &inode->ext_header) {
+        memcpy(ext_recs(new_eh), recs, eh->entries * sizeof(extent_rec_t));
+        new_eh->entries = eh->entries;
+        ext_add_rec(inode, new_eh, pos, rec, NULL);
+
+        eh->depth++;
+        eh->entries = 1;
+        recs[0].lblk = ext_recs(new_eh)[0].lblk;
+        recs[0].pblk = new_blkno;
+        recs[0].len = 0;
+        ret = 0;
+    } else {
+        int half = (pos == eh->entries) ? eh->entries : eh->entries / 2;
+        new_eh->entries = eh->entries - half;
+        memcpy(ext_recs(new_eh), &recs[half], new_eh->entries * sizeof(extent_rec_t));
+        eh->entries = half;
+        if (pos < half) {
+            ext_add_rec(inode, eh, pos, rec, NULL);
+        } else {
+            ext_add_rec(inode, new_eh, pos - half, rec, NULL);
+        }
+
+        split->lblk = ext_recs(new_eh)[0].lblk;
+        split->pblk = new_blkno;
+        split->len = 0;
+        ret = 1;
+    }
+
+    if (cache_write(new_blkno, new_block) < 0) {
+        ret = -1;
+    }
+    free(new_block);
+    return ret;
+}
+
+/*
+ * Add extent rec (blocks the file doesn't map yet) to the subtree under node eh, growing
+ * the extent before or after it instead if the new blocks continue it on disk as well.
+ * returns -1 on failure, else as ext_add_rec()
+ */
+static int ext_insert(inode_t *inode, extent_header_t *eh, const extent_rec_t *rec, extent_rec_t *split) {
+    extent_rec_t *recs = ext_recs(eh);
+    int i = ext_search(eh, rec->lblk);
+
+    if (eh->depth == 0) {
+        if (eh->entries > 0 && recs[i].lblk <= rec->lblk) {
+            extent_rec_t *prev = &recs[i];
+            if (prev->lblk + prev->len == rec->lblk && prev->pblk + prev->len == rec->pblk) {
+                prev->len += rec->len;
+                if (i + 1 < eh->entries && prev->lblk + prev->len == recs[i + 1].lblk && prev->pblk + prev->len == recs[i + 1].pblk) {
+                    prev->len += recs[i + 1].len;
+                    memmove(&recs[i + 1], &recs[i + 2], (eh->entries - i - 2) * sizeof(extent_rec_t));
+                    eh->entries--;
+                }
+                return 0;
+            }
+            i++;
+        }
+        if (i < eh->entries && rec->lblk + rec->len == recs[i].lblk && rec->pblk + rec->len == recs[i].pblk) {
+            recs[i].lblk = rec->lblk;
+            recs[i].pblk = rec->pblk;
+            recs[i].len += rec->len;
+            return 0;
+        }
+        return ext_add_rec(inode, eh, i, rec, split);
+    }
+
+    int child = recs[i].pblk;
+    char *child_block = malloc(BLOCK_SIZE);
+    if (child_block == NULL) {
+        return -1;
+    }
+    if (cache_read(child, child_block) < 0 || ((extent_header_t *)child_block)->magic != EXTENT_MAGIC) {
+        free(child_block);
+        return -1;
+    }
+
+    extent_rec_t child_split;
+    int ret = ext_insert(inode, (extent_header_t *)child_block, rec, &child_split);
+    if (ret >= 0 && cache_write(child, child_block) < 0) {
+        ret = -1;
+    }
+    free(child_block);
+
+    if (ret == 1) {
+        ret = ext_add_rec(inode, eh, i + 1, &child_split, split);
+    }
+    return ret;
+}
+
+/*
+ * Map count blocks of a file from logical block lblk on (not mapped yet) onto the data
+ * blocks from pblk on. Only the inode in memory changes, the caller writes it back.
+ */
+int bmap_insert(inode_t *inode, int lblk, int pblk, int count) {
+    if (lblk + count > bmap_max_blocks(inode)) {
+        return EXIT_FAILURE;
+    }
+    __atomic_add_fetch(&bmap_generation, 1, __ATOMIC_RELAXED);
+
+    if (!(inode->flags & INODE_EXTENTS)) {
+        return blockmap_insert(inode, lblk, pblk, count);
+    }
+
+    extent_rec_t rec = {.lblk = lblk, .pblk = pblk, .len = count};
+    return (ext_insert(inode, &inode->ext_header, &rec, NULL) < 0) ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+/*
+ * Free the blocks the subtree under node eh maps from logical block from on,
+ * along with the nodes under it left with nothing to map
+ */
+static int ext_truncate(extent_header_t *eh, uint32_t from) {
+    extent_rec_t *recs = ext_recs(eh);
+
+    // (from the last record back: the ones before a record that keeps blocks all do too)
+    while (eh->entries > 0) {
+        extent_rec_t *rec = &recs[eh->entries - 1];
+        if (eh->depth == 0) {
+            if (rec->lblk + rec->len <= from) {
+                break;
+            }
+            uint32_t keep = (rec->lblk < from) ? from - rec->lblk : 0;
+            for (uint32_t j = keep; j < rec->len; j++) {
+                if (release_blkno(rec->pblk + j) != EXIT_SUCCESS) {
+                    return EXIT_FAILURE;
+                }
+            }
+            rec->len = keep;
+            if (keep > 0) {
+                break;
+            }
+            eh->entries--;
+            continue;
+        }
+
+        char *child_block = malloc(BLOCK_SIZE);
+        if (child_block == NULL) {
+            return EXIT_FAILURE;
+        }
+        extent_header_t *child_eh = (extent_header_t *)child_block;
+        int ret_stat = EXIT_FAILURE;
+        if (cache_read(rec->pblk, child_block) >= 0 && child_eh->magic == EXTENT_MAGIC) {
+            ret_stat = ext_truncate(child_eh, from);
+        }
+        int emptied = (child_eh->entries == 0);
+        if (ret_stat == EXIT_SUCCESS && !emptied && cache_write(rec->pblk, child_block) < 0) {
+            ret_stat = EXIT_FAILURE;
+        }
+        free(child_block);
+
+        if (ret_stat != EXIT_SUCCESS) {
+            return EXIT_FAILURE;
+        }
+        if (!emptied) {
+            break;
+        }
+        if (release_blkno(rec->pblk) != EXIT_SUCCESS) {
+            return EXIT_FAILURE;
+        }
+        eh->entries--;
+    }
+
+    return EXIT_SUCCESS;
+}
+
+/*
+ * Free every block of a file from logical block from on. Only the inode in memory
+ * changes, the caller writes it back.
+ */
+int bmap_truncate(inode_t *inode, int from) {
+    __atomic_add_fetch(&bmap_generation, 1, __ATOMIC_RELAXED);
+
+    if (!(inode->flags & INODE_EXTENTS)) {
+        return blockmap_truncate(inode, from);
+    }
+
+    if (ext_truncate(&inode->ext_header, from) != EXIT_SUCCESS) {
+        return EXIT_FAILURE;
+    }
+    if (inode->ext_header.entries == 0) {
+        inode->ext_header.depth = 0;
+    }
+    return EXIT_SUCCESS;
+}
+
+/*
+ * Open files (fi->fh of a regular file): each remembers the run of consecutive blocks its last
+ * block lookup found, so reading or writing it sequentially maps the blocks of that run
+ * without another lookup (and, for an indirect mapped file, without another visit to its
+ * pointer blocks). The run is forgotten as soon as bmap_generation moves on.
+ */
+typedef struct open_file {
+    int ino;
+    pthread_mutex_t lock;
+    unsigned long map_gen;  // bmap_generation when the run was looked up
+    int lblk;               // the run: logical blocks lblk to lblk + len - 1 are at pblk on
+    int pblk;
+    int len;
+} open_file_t;
+
+static open_file_t *open_file_new(int ino) {
+    open_file_t *of = calloc(1, sizeof(open_file_t));
+    if (of != NULL) {
+        of->ino = ino;
+        pthread_mutex_init(&of->lock, NULL);
+    }
+    return of;
+}
+
+static void open_file_free(open_file_t *of) {
+    pthread_mutex_destroy(&of->lock);
+    free(of);
+}
+
+// the open file behind fi (NULL if there is none)
+static open_file_t *open_file_of(struct fuse_file_info *fi) {
+    return (fi != NULL) ? (open_file_t *)(uintptr_t)fi->fh : NULL;
+}
+
+/*
+ * bmap() of a block of an open file, from the run it remembers if lblk is in it
+ * (of may be NULL, or remember another file, then it is just bmap())
+ */
+static int bmap_cached(open_file_t *of, const inode_t *inode, int lblk) {
+    if (of == NULL || of->ino != inode->ino) {
+        return bmap(inode, lblk, NULL);
+    }
+
+    unsigned long gen = __atomic_load_n(&bmap_generation, __ATOMIC_RELAXED);
+    pthread_mutex_lock(&of->lock);
+    if (of->len > 0 && of->map_gen == gen && lblk >= of->lblk && lblk < of->lblk + of->len) {
+        int pblk = of->pblk + (lblk - of->lblk);
+        pthread_mutex_unlock(&of->lock);
+        return pblk;
+    }
+    pthread_mutex_unlock(&of->lock);
+
+    int run;
+    int pblk = bmap(inode, lblk, &run);
+    if (pblk > 0) {
+        pthread_mutex_lock(&of->lock);
+        of->map_gen = gen;
+        of->lblk = lblk;
+        of->pblk = pblk;
+        of->len = run;
+        pthread_mutex_unlock(&of->lock);
+    }
+    return pblk;
+}
+
+/*
+ * Directory index (see rufs.h): a directory starts out as a plain list of records in its
+ * first block, and is turned into an indexed one when that block fills up. From then on it
+ * is a B+tree keyed by name hash: a name is looked up, added or removed by reading one index
+ * block per level and then the one leaf its hash leads to, and the leaves are chained in hash
+ * order for readdir. A full leaf or index block is split in two, and a full root moves down
+ * a level, so the tree stays balanced however large the directory gets.
+ */
+#define DX_LIMIT ((BLOCK_SIZE - sizeof(dx_header_t)) / sizeof(dx_entry_t))
+#define DX_MAX_LEVELS 3  // index levels below the root at most (far more leaves than a directory can map)
+
+// 32-bit FNV-1a hash of a name
+static uint32_t name_hash(const char *name, size_t len) {
+    uint32_t h = 2166136261u;
+    for (size_t i = 0; i < len; i++) {
+        h = (h ^ (unsigned char)name[i]) * 16777619u;
+    }
+    return h;
+}
+
+static dx_entry_t *dx_entries(const dx_header_t *dh) {
+    return (dx_entry_t *)(dh + 1);
+}
+
+// index of the entry of an index block leading to the names with hash h
+static int dx_search(const dx_header_t *dh, uint32_t h) {
+    const dx_entry_t *entries = dx_entries(dh);
+    int lo = 1;
+    int hi = dh->count - 1;
+    int found = 0;
+    while (lo <= hi) {
+        int mid = (lo + hi) / 2;
+        if (entries[mid].hash <= h) {
+            found = mid;
+            lo = mid + 1;
+        } else {
+            hi = mid - 1;
+        }
+    }
+    return found;
+}
+
+/*
+ * the directory block of the leaf for names with hash h, found from the root down, one index
+ * block per level (-1 if the index can't be read)
+ */
+static int dx_leaf(const inode_t *dir_inode, uint32_t h) {
+    int lblk = 0;
+    int levels = 0;
+    for (int depth = 0; depth <= levels; depth++) {
+        int index_block = bmap(dir_inode, lblk, NULL);
+        if (index_block < data_block_start) {
+            return -1;
+        }
+
+        const dx_header_t *dh = cache_get(index_block);
+        if (dh == NULL) {
+            return -1;
+        }
+        if (dh->magic != DX_MAGIC || dh->count == 0 || (depth == 0 && dh->levels > DX_MAX_LEVELS)) {
+            cache_put(index_block);
+            return -1;
+        }
+        if (depth == 0) {
+            levels = dh->levels;
+        }
+        lblk = dx_entries(dh)[dx_search(dh, h)].block;
+        cache_put(index_block);
+    }
+    return lblk;
+}
+
+static dir_rec_t *dir_rec(const char *block, int off) {
+    return (dir_rec_t *)(block + off);
+}
+
+static dir_tail_t *dir_tail(const char *block) {
+    return (dir_tail_t *)(block + DIR_BLOCK_SPACE);
+}
+
+// an empty directory block: a single unused record covering all of it, and no next leaf
+static void leaf_init(char *block) {
+    memset(block, 0, BLOCK_SIZE);
+    dir_rec(block, 0)->rec_len = DIR_BLOCK_SPACE;
+}
+
+/*
+ * The next record of a directory block after the one at off (-1 past the last one,
+ * or if the record at off is damaged)
+ */
+static int leaf_next(const char *block, int off) {
+    int rec_len = dir_rec(block, off)->rec_len;
+    if (rec_len < (int)sizeof(dir_rec_t) || off + rec_len >= DIR_BLOCK_SPACE) {
+        return -1;
+    }
+    return off + rec_len;
+}
+
+// offset of the record for a name in a directory block (-1 if it isn't there)
+static int leaf_find(const char *block, const char *fname, size_t name_len) {
+    for (int off = 0; off != -1; off = leaf_next(block, off)) {
+        const dir_rec_t *rec = dir_rec(block, off);
+        if (rec->name_len != 0 && rec->name_len == name_len && memcmp(rec + 1, fname, name_len) == 0) {
+            return off;
+        }
+    }
+    return -1;
+}
+
+/*
+ * Put a record for a name into a directory block: into the first unused record, or free
+ * space at the end of a used one, that has room for it. returns EXIT_FAILURE if none has
+ */
+static int leaf_insert(char *block, uint32_t ino, const char *fname, size_t name_len) {
+    int need = DIR_REC_SIZE(name_len);
+    for (int off = 0; off != -1; off = leaf_next(block, off)) {
+        dir_rec_t *rec = dir_rec(block, off);
+        int used = (rec->name_len != 0) ? DIR_REC_SIZE(rec->name_len) : 0;
+        if (rec->rec_len - used < need) {
+            continue;
+        }
+
+        // the free space at the end of a used record becomes a record of its own
+        if (used != 0) {
+            dir_rec_t *free_rec = dir_rec(block, off + used);
+            free_rec->rec_len = rec->rec_len - used;
+            rec->rec_len = used;
+            rec = free_rec;
+        }
+        rec->ino = ino;
+        rec->name_len = name_len;
+        rec->pad = 0;
+        memcpy(rec + 1, fname, name_len);
+        return EXIT_SUCCESS;
+    }
+    return EXIT_FAILURE;
+}
+
+/*
+ * Take the record at off out of a directory block: its space goes to the record before it,
+ * or if it is the first one, it is just marked unused
+ */
+static void leaf_remove(char *block, int off) {
+    int prev = -1;
+    for (int cur = 0; cur != off && cur != -1; cur = leaf_next(block, cur)) {
+        prev = cur;
+    }
+
+    dir_rec_t *rec = dir_rec(block, off);
+    if (prev != -1) {
+        dir_rec(block, prev)->rec_len += rec->rec_len;
+    } else {
+        rec->ino = 0;
+        rec->name_len = 0;
+    }
+}
+
+/*
+ * The block of a directory the names with hash h are in: of an indexed directory the leaf
+ * the hash leads to, else its only block. returns -1 if the index can't be read
+ */
+static int dir_hash_block(const inode_t *dir_inode, uint32_t h) {
+    if (dir_inode->flags & INODE_INDEXED) {
+        return dx_leaf(dir_inode, h);
+    }
+    return 0;
+}
+
+/*
+ * Turn a linear directory whose one block is full into an indexed one: its dirents move to
+ * a new block, which becomes the only leaf, and the first block becomes the root of the index.
+ * The directory inode is written back here, so a directory is either still linear or fully
+ * indexed whatever the caller does next.
+ */
+static int dx_convert(inode_t *dir_inode) {
+    char *block = bio_alloc(2 * BLOCK_SIZE);  // the first block's dirents, then the root
+    if (block == NULL) {
+        return EXIT_FAILURE;
+    }
+    char *root = block + BLOCK_SIZE;
+    int first_block = bmap(dir_inode, 0, NULL);
+    if (first_block < data_block_start || cache_read(first_block, block) < 0) {
+        free(block);
+        return EXIT_FAILURE;
+    }
+
+    // Step 1: Give the directory a second block, for the leaf
+    int leaf_block = get_avail_blkno(first_block + 1);
+    if (leaf_block == -1) {
+        free(block);
+        return EXIT_FAILURE;
+    }
+    if (bmap_insert(dir_inode, 1, leaf_block, 1) != EXIT_SUCCESS) {
+        release_blkno(leaf_block);
+        free(block);
+        return EXIT_FAILURE;
+    }
+
+    // Step 2: Move the dirents there, put the root in the first block and write the inode back
+    memset(root, 0, BLOCK_SIZE);
+    dx_header_t *dh = (dx_header_t *)root;
+    dh->magic = DX_MAGIC;
+    dh->count = 1;
+    dh->limit = DX_LIMIT;
+    dh->levels = 0;
+    dh->blocks = 2;
+    dx_entries(dh)[0] = (dx_entry_t){.hash = 0, .block = 1};
+    dir_inode->flags |= INODE_INDEXED;
+    if (cache_write(leaf_block, block) >= 0 && cache_write(first_block, root) >= 0) {
+        if (writei(dir_inode->ino, dir_inode) == EXIT_SUCCESS) {
+            free(block);
+            return EXIT_SUCCESS;
+        }
+        cache_write(first_block, block);
+    }
+
+    // Step 3: Else the directory stays linear, and the leaf's block goes back
+    dir_inode->flags &= ~INODE_INDEXED;
+    bmap_truncate(dir_inode, 1);
+    free(block);
+    return EXIT_FAILURE;
+}
+
+/*
+ * The index blocks from the root of a directory's index down to the leaf for a hash
+ * (node[0] is the root), and which entry of each one leads on down
+ */
+typedef struct dx_path {
+    int depth;                         // index blocks on the path
+    int lblk[DX_MAX_LEVELS + 1];       // their blocks in the directory
+    int at[DX_MAX_LEVELS + 1];         // the entry followed in each
+    char *node[DX_MAX_LEVELS + 2];     // their contents (with a spare one for a root that moves down)
+} dx_path_t;
+
+/*
+ * Read the index blocks on the way to the leaf for hash h into path (node buffers set up
+ * by the caller). returns the leaf's block in the directory, or -1 if the index can't be read
+ */
+static int dx_walk(const inode_t *dir_inode, uint32_t h, dx_path_t *path) {
+    int lblk = 0;
+    int levels = 0;
+    for (path->depth = 0; path->depth <= levels; path->depth++) {
+        int k = path->depth;
+        int index_block = bmap(dir_inode, lblk, NULL);
+        if (index_block < data_block_start || cache_read(index_block, path->node[k]) < 0) {
+            return -1;
+        }
+
+        dx_header_t *dh = (dx_header_t *)path->node[k];
+        if (dh->magic != DX_MAGIC || dh->count == 0) {
+            return -1;
+        }
+        if (k == 0) {
+            levels = dh->levels;
+            if (levels > DX_MAX_LEVELS) {
+                return -1;
+            }
+        }
+        path->lblk[k] = lblk;
+        path->at[k] = dx_search(dh, h);
+        lblk = dx_entries(dh)[path->at[k]].block;
+    }
+    return lblk;
+}
+
+/*
+ * Give a directory a new block, next to the last one it got (root: the root of its index,
+ * which counts them). returns its block in the directory and its data block in *blkno, or -1
+ */
+static int dx_new_block(inode_t *dir_inode, dx_header_t *root, int *blkno) {
+    int lblk = root->blocks;
+    int prev_block = bmap(dir_inode, lblk - 1, NULL);
+    int new_block = get_avail_blkno((prev_block >= data_block_start) ? prev_block + 1 : inode_data_goal(dir_inode->ino));
+    if (new_block == -1) {
+        return -1;
+    }
+    if (bmap_insert(dir_inode, lblk, new_block, 1) != EXIT_SUCCESS) {
+        release_blkno(new_block);
+        return -1;
+    }
+
+    root->blocks++;
+    *blkno = new_block;
+    return lblk;
+}
+
+static int dx_write_node(const inode_t *dir_inode, dx_path_t *path, int k) {
+    int index_block = bmap(dir_inode, path->lblk[k], NULL);
+    return (index_block >= data_block_start && cache_write(index_block, path->node[k]) >= 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+/*
+ * Insert an entry into the index block at depth k of a path, right after the one the path
+ * follows. A full block is split in two, its upper half moving to a new block that gets an
+ * entry of its own one level up, and a full root first moves down a level (into a new block,
+ * leaving the root with a single entry). Every index block changed is written back, but only
+ * once all the new blocks have been found, so on failure nothing has been written.
+ */
+static int dx_insert_entry(inode_t *dir_inode, dx_path_t *path, int k, dx_entry_t entry) {
+    dx_header_t *root = (dx_header_t *)path->node[0];
+    dx_header_t *dh = (dx_header_t *)path->node[k];
+
+    // Step 1: A full root moves down a level first, then it is its new child that splits
+    if (dh->count == dh->limit && k == 0) {
+        if (path->depth == DX_MAX_LEVELS + 1) {
+            return EXIT_FAILURE;
+        }
+        int child_block;
+        int child = dx_new_block(dir_inode, root, &child_block);
+        if (child == -1) {
+            return EXIT_FAILURE;
+        }
+
+        char *spare = path->node[path->depth];
+        memmove(&path->node[2], &path->node[1], (path->depth - 1) * sizeof(char *));
+        memmove(&path->lblk[2], &path->lblk[1], (path->depth - 1) * sizeof(int));
+        memmove(&path->at[2], &path->at[1], (path->depth - 1) * sizeof(int));
+        path->node[1] = spare;
+        path->depth++;
+
+        memcpy(path->node[1], path->node[0], BLOCK_SIZE);
+        ((dx_header_t *)path->node[1])->blocks = 0;
+        path->lblk[1] = child;
+        path->at[1] = path->at[0];
+
+        root->count = 1;
+        root->levels++;
+        dx_entries(root)[0] = (dx_entry_t){.hash = 0, .block = child};
+        path->at[0] = 0;
+        return dx_insert_entry(dir_inode, path, 1, entry);
+    }
+
+    // Step 2: Room for it: just put it in
+    int pos = path->at[k] + 1;
+    if (dh->count < dh->limit) {
+        dx_entry_t *entries = dx_entries(dh);
+        memmove(&entries[pos + 1], &entries[pos], (dh->count - pos) * sizeof(dx_entry_t));
+        entries[pos] = entry;
+        dh->count++;
+        if (dx_write_node(dir_inode, path, k) != EXIT_SUCCESS) {
+            return EXIT_FAILURE;
+        }
+        return (k == 0) ? EXIT_SUCCESS : dx_write_node(dir_inode, path, 0);  // (the root counts the blocks)
+    }
+
+    // Step 3: Else split the block, putting it in whichever half it belongs in
+    int new_block;
+    int new_lblk = dx_new_block(dir_inode, root, &new_block);
+    if (new_lblk == -1) {
+        return EXIT_FAILURE;
+    }
+    char *new_node = bio_alloc(BLOCK_SIZE);
+    if (new_node == NULL) {
+        return EXIT_FAILURE;
+    }
+    int half = dh->count / 2;
+    memset(new_node, 0, BLOCK_SIZE);
+    dx_header_t *new_dh = (dx_header_t *)new_node;
+    *new_dh = (dx_header_t){.magic = DX_MAGIC, .count = dh->count - half, .limit = dh->limit, .levels = dh->levels};
+    memcpy(dx_entries(new_dh), dx_entries(dh) + half, new_dh->count * sizeof(dx_entry_t));
+    dh->count = half;
+
+    dx_header_t *target = (pos > half) ? new_dh : dh;
+    int target_pos = (pos > half) ? pos - half : pos;
+    dx_entry_t *entries = dx_entries(target);
+    memmove(&entries[target_pos + 1], &entries[target_pos], (target->count - target_pos) * sizeof(dx_entry_t));
+    entries[target_pos] = entry;
+    target->count++;
+
+    // (the new block's entry goes in one level up before either half is written, so a split
+    // that can't be finished leaves the index as it was; a root moving down shifts the path)
+    dx_entry_t up = {.hash = dx_entries(new_dh)[0].hash, .block = new_lblk};
+    int depth = path->depth;
+    int ret_stat = EXIT_FAILURE;
+    if (dx_insert_entry(dir_inode, path, k - 1, up) == EXIT_SUCCESS &&
+        dx_write_node(dir_inode, path, k + (path->depth - depth)) == EXIT_SUCCESS && cache_write(new_block, new_node) >= 0) {
+        ret_stat = EXIT_SUCCESS;
+    }
+    free(new_node);
+    return ret_stat;
+}
+
+// whether the index blocks of a path can take another entry (splitting as far up as need be)
+static int dx_has_room(const dx_path_t *path) {
+    for (int k = path->depth - 1; k >= 0; k--) {
+        const dx_header_t *dh = (const dx_header_t *)path->node[k];
+        if (dh->count < dh->limit) {
+            return 1;
+        }
+    }
+    return path->depth <= DX_MAX_LEVELS;
+}
+
+typedef struct dx_sort {
+    uint32_t hash;
+    int off;  // of the record in its block
+} dx_sort_t;
+
+static int compare_dx_sort(const void *a, const void *b) {
+    const dx_sort_t *x = a;
+    const dx_sort_t *y = b;
+    return (x->hash > y->hash) - (x->hash < y->hash);
+}
 
-                // check to see if the dirent matches
-                if (strcmp(fname, temp_dirent.name) == 0 && name_len == temp_dirent.len) {
+/*
+ * Split the full leaf at the end of a path in two: the records with the higher half of its
+ * hashes move to a new leaf, which comes right after it in the chain of leaves and gets an
+ * entry of its own in the index (both leaves and the index are written back). leaf holds the
+ * old leaf's block, and is left holding whichever of the two the hash h belongs in,
+ * *leaf_block that one's block.
+ */
+static int dx_split(inode_t *dir_inode, dx_path_t *path, char *leaf, int *leaf_block, uint32_t h) {
+    if (!dx_has_room(path)) {
+        return EXIT_FAILURE;
+    }
+
+    // Step 1: Order the records by hash and find the middle (names of one hash stay together)
+    dx_sort_t sorted[DIR_BLOCK_SPACE / sizeof(dir_rec_t)];
+    int n = 0;
+    for (int off = 0; off != -1; off = leaf_next(leaf, off)) {
+        const dir_rec_t *rec = dir_rec(leaf, off);
+        if (rec->name_len != 0) {
+            sorted[n].hash = name_hash((const char *)(rec + 1), rec->name_len);
+            sorted[n++].off = off;
+        }
+    }
+    qsort(sorted, n, sizeof(dx_sort_t), compare_dx_sort);
+
+    int split = n / 2;
+    while (split < n && sorted[split].hash == sorted[split - 1].hash) {
+        split++;
+    }
+    if (split == n) {
+        for (split = n / 2; split > 0 && sorted[split].hash == sorted[split - 1].hash; split--) {
+        }
+        if (split == 0) {
+            return EXIT_FAILURE;  // every name in the leaf has the same hash
+        }
+    }
+    uint32_t split_hash = sorted[split].hash;
+
+    // Step 2: Give the directory a block for the new leaf
+    char *old_leaf = bio_alloc(2 * BLOCK_SIZE);  // a copy of the full leaf, then the new leaf
+    if (old_leaf == NULL) {
+        return EXIT_FAILURE;
+    }
+    char *new_leaf = old_leaf + BLOCK_SIZE;
+    dx_header_t *root = (dx_header_t *)path->node[0];
+    uint32_t blocks = root->blocks;
+    int new_block;
+    int new_lblk = dx_new_block(dir_inode, root, &new_block);
+    if (new_lblk == -1) {
+        free(old_leaf);
+        return EXIT_FAILURE;
+    }
+
+    // Step 3: Pack each half into a leaf of its own, the new one next in the chain
+    memcpy(old_leaf, leaf, BLOCK_SIZE);
+    leaf_init(leaf);
+    leaf_init(new_leaf);
+    for (int i = 0; i < n; i++) {
+        const dir_rec_t *rec = dir_rec(old_leaf, sorted[i].off);
+        leaf_insert((i < split) ? leaf : new_leaf, rec->ino, (const char *)(rec + 1), rec->name_len);
+    }
+    dir_tail(new_leaf)->next = dir_tail(old_leaf)->next;
+    dir_tail(leaf)->next = new_lblk;
+
+    // Step 4: Give the new leaf its entry in the index, then write both halves. If the index
+    // can't take it nothing has been written yet: the leaf is put back as it was, and the
+    // blocks the directory got for the split are given back
+    int ret_stat = EXIT_FAILURE;
+    if (dx_insert_entry(dir_inode, path, path->depth - 1, (dx_entry_t){.hash = split_hash, .block = new_lblk}) != EXIT_SUCCESS) {
+        memcpy(leaf, old_leaf, BLOCK_SIZE);
+        root->blocks = blocks;
+        if (bmap_truncate(dir_inode, blocks) == EXIT_SUCCESS) {
+            writei(dir_inode->ino, dir_inode);
+        }
+    } else if (cache_write(*leaf_block, leaf) >= 0 && cache_write(new_block, new_leaf) >= 0) {
+        ret_stat = EXIT_SUCCESS;
+        if (h >= split_hash) {
+            memcpy(leaf, new_leaf, BLOCK_SIZE);
+            *leaf_block = new_block;
+        }
+    }
+    free(old_leaf);
+    return ret_stat;
+}
+
+/*
+ * dir_add() for an indexed directory: the dirent goes into the leaf its hash leads to,
+ * which is split first if it is full
+ */
+static int dx_add(inode_t *dir_inode, uint32_t f_ino, const char *fname, size_t name_len) {
+    uint32_t h = name_hash(fname, name_len);
+    char *blocks = bio_alloc((DX_MAX_LEVELS + 3) * BLOCK_SIZE);  // the path's index blocks, then the leaf
+    if (blocks == NULL) {
+        return EXIT_FAILURE;
+    }
+    dx_path_t path;
+    for (int k = 0; k < DX_MAX_LEVELS + 2; k++) {
+        path.node[k] = blocks + (k * BLOCK_SIZE);
+    }
+    char *leaf = blocks + ((DX_MAX_LEVELS + 2) * BLOCK_SIZE);
+
+    // Step 1: Find the name's leaf through the index, it can only be there if it already exists
+    int leaf_lblk = dx_walk(dir_inode, h, &path);
+    int leaf_block = (leaf_lblk == -1) ? -1 : bmap(dir_inode, leaf_lblk, NULL);
+    if (leaf_block < data_block_start || cache_read(leaf_block, leaf) < 0 || leaf_find(leaf, fname, name_len) != -1) {
+        free(blocks);
+        return EXIT_FAILURE;
+    }
+
+    // Step 2: Put the record there, making room by splitting the leaf if there is none
+    if (leaf_insert(leaf, f_ino, fname, name_len) != EXIT_SUCCESS) {
+        if (dx_split(dir_inode, &path, leaf, &leaf_block, h) != EXIT_SUCCESS ||
+            leaf_insert(leaf, f_ino, fname, name_len) != EXIT_SUCCESS) {
+            free(blocks);
+            return EXIT_FAILURE;
+        }
+    }
+    int write_ret_stat = cache_write(leaf_block, leaf);
+    free(blocks);
+    if (write_ret_stat < 0) {
+        return EXIT_FAILURE;
+    }
+
+    // Step 3: Update the directory inode
+    dir_inode->size += DIR_REC_SIZE(name_len);
+    dir_inode->link += 1;
+    dir_inode->mtime = dir_inode->ctime = now_ns();
+    return writei(dir_inode->ino, dir_inode);
+}
+
+/*
+ * Dentry cache: what looking a name up in a directory found, keyed by the directory's
+ * inode number and the name, so each step of a path walk only reads the directory the first
+ * time. Names that aren't there are cached too (as ino -1), since failed lookups are as common
+ * as successful ones. dir_add() and dir_remove() set the entry of the name they change, so
+ * an entry never goes stale. (A directory is empty when it is removed, so whatever is cached
+ * under its inode number is negative, which is also right for the next directory given it.)
+ */
+#define DCACHE_ENTRIES 4096
+#define DCACHE_BUCKETS 4096
+#define DCACHE_NAME_LEN 64  // longer names aren't cached
+
+typedef struct dcache_entry {
+    int parent;                            // -1: unused
+    int ino;                               // -1: the name isn't in the directory
+    uint32_t hash;                         // name_hash() of the name
+    uint16_t len;
+    char name[DCACHE_NAME_LEN];
+    struct dcache_entry *hnext;            // hash chain
+    struct dcache_entry *prev, *next;      // LRU list, most recently used first
+} dcache_entry_t;
+
+static dcache_entry_t dcache[DCACHE_ENTRIES];
+static dcache_entry_t *dcache_hash[DCACHE_BUCKETS];
+static dcache_entry_t *dcache_head = NULL;
+static dcache_entry_t *dcache_tail = NULL;
+static pthread_mutex_t dcache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void dcache_lru_unlink(dcache_entry_t *e) {
+    if (e->prev != NULL) {
+        e->prev->next = e->next;
+    } else {
+        dcache_head = e->next;
+    }
+    if (e->next != NULL) {
+        e->next->prev = e->prev;
+    } else {
+        dcache_tail = e->prev;
+    }
+    e->prev = e->next = NULL;
+}
+
+static void dcache_lru_push(dcache_entry_t *e) {
+    e->prev = NULL;
+    e->next = dcache_head;
+    if (dcache_head != NULL) {
+        dcache_head->prev = e;
+    }
+    dcache_head = e;
+    if (dcache_tail == NULL) {
+        dcache_tail = e;
+    }
+}
+
+static int dcache_bucket(int parent, uint32_t hash) {
+    return (hash ^ ((uint32_t)parent * 2654435761u)) % DCACHE_BUCKETS;
+}
+
+// the entry for a name (dcache_lock held), NULL if it isn't cached
+static dcache_entry_t *dcache_find(int parent, const char *name, size_t len, uint32_t hash) {
+    for (dcache_entry_t *e = dcache_hash[dcache_bucket(parent, hash)]; e != NULL; e = e->hnext) {
+        if (e->parent == parent && e->hash == hash && e->len == len && memcmp(e->name, name, len) == 0) {
+            return e;
+        }
+    }
+    return NULL;
+}
+
+static void dcache_hash_remove(dcache_entry_t *e) {
+    dcache_entry_t **p = &dcache_hash[dcache_bucket(e->parent, e->hash)];
+    while (*p != e) {
+        p = &(*p)->hnext;
+    }
+    *p = e->hnext;
+}
+
+static void dcache_init() {
+    memset(dcache_hash, 0, sizeof(dcache_hash));
+    dcache_head = dcache_tail = NULL;
+    for (int i = 0; i < DCACHE_ENTRIES; i++) {
+        dcache[i].parent = -1;
+        dcache[i].hnext = NULL;
+        dcache_lru_push(&dcache[i]);
+    }
+}
+
+/*
+ * Look a name (with name_hash() hash) up in the cache: returns 1 with its inode number in *ino (-1 if the
+ * directory doesn't have it), or 0 if the cache doesn't know
+ */
+static int dcache_lookup(int parent, const char *name, size_t len, uint32_t hash, int *ino) {
+    if (len >= DCACHE_NAME_LEN) {
+        return 0;
+    }
+
+    pthread_mutex_lock(&dcache_lock);
+    dcache_entry_t *e = dcache_find(parent, name, len, hash);
+    if (e != NULL) {
+        *ino = e->ino;
+        dcache_lru_unlink(e);
+        dcache_lru_push(e);
+    }
+    pthread_mutex_unlock(&dcache_lock);
+
+    return e != NULL;
+}
+
+/*
+ * Record what a name is in a directory (ino -1: it isn't there), in its existing entry
+ * or else in the least recently used one
+ */
+static void dcache_enter(int parent, const char *name, size_t len, uint32_t hash, int ino) {
+    if (len >= DCACHE_NAME_LEN) {
+        return;
+    }
+
+    pthread_mutex_lock(&dcache_lock);
+    dcache_entry_t *e = dcache_find(parent, name, len, hash);
+    if (e == NULL) {
+        e = dcache_tail;
+        if (e->parent != -1) {
+            dcache_hash_remove(e);
+        }
+        e->parent = parent;
+        e->hash = hash;
+        e->len = len;
+        memcpy(e->name, name, len);
+        e->hnext = dcache_hash[dcache_bucket(parent, hash)];
+        dcache_hash[dcache_bucket(parent, hash)] = e;
+    }
+    e->ino = ino;
+    dcache_lru_unlink(e);
+    dcache_lru_push(e);
+    pthread_mutex_unlock(&dcache_lock);
+}
+
+/*
+ * Path cache: what inode a whole path led to, so that looking it up again is one probe
+ * instead of a walk. An entry keeps the directories the walk went through, with the
+ * generation each one had when the walk looked into it, and is only good while none of
+ * them has changed since. Only paths that exist are cached, and adding a name to a directory
+ * can't change where those lead, so it is dir_remove() that moves a directory on to its
+ * next generation (and rmdir, for the directory itself). Directories share the generation
+ * slot their inode number hashes to, which at worst costs a path a spurious miss.
+ * The cache is split into stripes by path hash, each with its own lock, entries and LRU list,
+ * and has -o path_cache=N entries in all (0: no path cache).
+ */
+#define PCACHE_STRIPES 16
+#define PCACHE_PATH_LEN 192  // longer paths aren't cached
+#define PCACHE_DEPTH 24      // nor ones through more directories
+#define DGEN_SLOTS 16384
+
+typedef struct pcache_entry {
+    uint32_t hash;                         // name_hash() of the path
+    uint16_t len;                          // 0: unused
+    uint16_t depth;                        // directories the walk went through
+    int ino;
+    int dirs[PCACHE_DEPTH];                // the directories, from the root down
+    uint32_t gens[PCACHE_DEPTH];           // and their generations then
+    char path[PCACHE_PATH_LEN];
+    struct pcache_entry *hnext;            // hash chain
+    struct pcache_entry *prev, *next;      // LRU list of its stripe, most recently used first
+} pcache_entry_t;
+
+typedef struct pcache_stripe {
+    pthread_mutex_t lock;
+    int nentries;                          // entries (and hash buckets) of the stripe
+    pcache_entry_t *entries;
+    pcache_entry_t **hash;
+    pcache_entry_t *head, *tail;
+} pcache_stripe_t;
+
+static pcache_stripe_t pcache[PCACHE_STRIPES];
+static pcache_entry_t *pcache_entries = NULL;
+static pcache_entry_t **pcache_buckets = NULL;
+static uint32_t dir_gens[DGEN_SLOTS];
+static unsigned long pcache_hits = 0;    // lookups the cache answered and didn't (reported under -d)
+static unsigned long pcache_misses = 0;
+
+static uint32_t dir_gen(int ino) {
+    return __atomic_load_n(&dir_gens[ino % DGEN_SLOTS], __ATOMIC_ACQUIRE);
+}
+
+// a directory has changed: every cached path through it is stale (call after the change)
+static void dir_gen_bump(int ino) {
+    __atomic_add_fetch(&dir_gens[ino % DGEN_SLOTS], 1, __ATOMIC_RELEASE);
+}
+
+static void pcache_lru_unlink(pcache_stripe_t *s, pcache_entry_t *e) {
+    if (e->prev != NULL) {
+        e->prev->next = e->next;
+    } else {
+        s->head = e->next;
+    }
+    if (e->next != NULL) {
+        e->next->prev = e->prev;
+    } else {
+        s->tail = e->prev;
+    }
+    e->prev = e->next = NULL;
+}
+
+static void pcache_lru_push(pcache_stripe_t *s, pcache_entry_t *e) {
+    e->prev = NULL;
+    e->next = s->head;
+    if (s->head != NULL) {
+        s->head->prev = e;
+    }
+    s->head = e;
+    if (s->tail == NULL) {
+        s->tail = e;
+    }
+}
+
+static pcache_stripe_t *pcache_stripe(uint32_t hash) {
+    return &pcache[hash % PCACHE_STRIPES];
+}
+
+static pcache_entry_t **pcache_bucket(pcache_stripe_t *s, uint32_t hash) {
+    return &s->hash[(hash / PCACHE_STRIPES) % s->nentries];
+}
+
+static void pcache_hash_remove(pcache_stripe_t *s, pcache_entry_t *e) {
+    pcache_entry_t **p = pcache_bucket(s, e->hash);
+    while (*p != e) {
+        p = &(*p)->hnext;
+    }
+    *p = e->hnext;
+}
+
+static int pcache_init(unsigned int size) {
+    int per_stripe = size / PCACHE_STRIPES;
+    if (per_stripe == 0) {
+        return EXIT_SUCCESS;
+    }
+    pcache_entries = calloc((size_t)per_stripe * PCACHE_STRIPES, sizeof(pcache_entry_t));
+    pcache_buckets = calloc((size_t)per_stripe * PCACHE_STRIPES, sizeof(pcache_entry_t *));
+    if (pcache_entries == NULL || pcache_buckets == NULL) {
+        free(pcache_entries);
+        free(pcache_buckets);
+        pcache_entries = NULL;
+        pcache_buckets = NULL;
+        return EXIT_FAILURE;
+    }
+
+    for (int i = 0; i < PCACHE_STRIPES; i++) {
+        pcache_stripe_t *s = &pcache[i];
+        pthread_mutex_init(&s->lock, NULL);
+        s->nentries = per_stripe;
+        s->entries = &pcache_entries[i * per_stripe];
+        s->hash = &pcache_buckets[i * per_stripe];
+        s->head = s->tail = NULL;
+        for (int j = 0; j < per_stripe; j++) {
+            pcache_lru_push(s, &s->entries[j]);
+        }
+    }
+    return EXIT_SUCCESS;
+}
+
+static void pcache_destroy() {
+    if (config.debug) {
+        fprintf(stderr, "rufs: path cache %lu hits, %lu misses\n", pcache_hits, pcache_misses);
+    }
+    free(pcache_entries);
+    free(pcache_buckets);
+    pcache_entries = NULL;
+    pcache_buckets = NULL;
+}
+
+/*
+ * Look a path (with name_hash() hash) up in the cache: returns 1 with the inode number it
+ * leads to in *ino, or 0 if the cache doesn't have it (any more, a stale entry is dropped)
+ */
+static int pcache_lookup(const char *path, size_t len, uint32_t hash, int *ino) {
+    if (pcache_entries == NULL || len >= PCACHE_PATH_LEN) {
+        return 0;
+    }
+
+    pcache_stripe_t *s = pcache_stripe(hash);
+    pthread_mutex_lock(&s->lock);
+    pcache_entry_t *e = *pcache_bucket(s, hash);
+    while (e != NULL && !(e->hash == hash && e->len == len && memcmp(e->path, path, len) == 0)) {
+        e = e->hnext;
+    }
+
+    int found = 0;
+    if (e != NULL) {
+        found = 1;
+        for (int d = 0; d < e->depth && found; d++) {
+            found = (dir_gen(e->dirs[d]) == e->gens[d]);
+        }
 
-                    printf("***********dir_remove() target fname: %s, current fname: %s\n", fname, temp_dirent.name);
+        pcache_lru_unlink(s, e);
+        if (found) {
+            *ino = e->ino;
+            pcache_lru_push(s, e);
+        } else {
+            // stale: its entry goes to the end of the LRU list, to be the next one reused
+            pcache_hash_remove(s, e);
+            e->len = 0;
+            e->prev = s->tail;
+            if (s->tail != NULL) {
+                s->tail->next = e;
+            }
+            s->tail = e;
+            if (s->head == NULL) {
+                s->head = e;
+            }
+        }
+    }
+    pthread_mutex_unlock(&s->lock);
+
+    __atomic_add_fetch(found ? &pcache_hits : &pcache_misses, 1, __ATOMIC_RELAXED);
+    return found;
+}
+
+/*
+ * Record where a path leads, and the directories (with their generations, read before
+ * each was looked into) that the walk went through
+ */
+static void pcache_enter(const char *path, size_t len, uint32_t hash, int depth, const int *dirs, const uint32_t *gens, int ino) {
+    if (pcache_entries == NULL || len >= PCACHE_PATH_LEN || depth > PCACHE_DEPTH) {
+        return;
+    }
+
+    pcache_stripe_t *s = pcache_stripe(hash);
+    pthread_mutex_lock(&s->lock);
+    pcache_entry_t *e = *pcache_bucket(s, hash);
+    while (e != NULL && !(e->hash == hash && e->len == len && memcmp(e->path, path, len) == 0)) {
+        e = e->hnext;
+    }
+    if (e == NULL) {
+        e = s->tail;
+        if (e->len != 0) {
+            pcache_hash_remove(s, e);
+        }
+        e->hash = hash;
+        e->len = len;
+        memcpy(e->path, path, len);
+        e->hnext = *pcache_bucket(s, hash);
+        *pcache_bucket(s, hash) = e;
+    }
+    e->ino = ino;
+    e->depth = depth;
+    memcpy(e->dirs, dirs, depth * sizeof(int));
+    memcpy(e->gens, gens, depth * sizeof(uint32_t));
+    pcache_lru_unlink(s, e);
+    pcache_lru_push(s, e);
+    pthread_mutex_unlock(&s->lock);
+}
+
+/*
+ * 	directory operations:
+        given the ino of the current directory,
+        check to see if a desired file or sub-directory exists,
+                if so, then save to struct dirent *dirent
+    returns 0, -ENOENT if the name isn't there, -ENOTDIR if ino isn't a directory,
+    or -EIO if the directory can't be read
+ */
+static int dir_lookup(uint32_t ino, const char *fname, size_t name_len, uint32_t hash, struct dirent *dirent) {
+    // Step 0: The dentry cache may already know whether the name is there
+    int cached_ino;
+    if (dcache_lookup(ino, fname, name_len, hash, &cached_ino)) {
+        if (cached_ino == -1) {
+            return -ENOENT;
+        }
+        memset(dirent, 0, sizeof(dirent_t));
+        dirent->ino = cached_ino;
+        dirent->valid = 1;
+        dirent->len = name_len;
+        memcpy(dirent->name, fname, name_len);
+        return 0;
+    }
+
+    // Step 1: Call readi() to get the inode using ino (inode number of current directory)
+
+    inode_t temp_inode;
+    if (readi(ino, &temp_inode) != EXIT_SUCCESS) {
+        return -EIO;
+    }
+    if (!S_ISDIR(temp_inode.type)) {
+        return -ENOTDIR;
+    }
+
+    // Step 2: Get the data block of current directory the name can be in
+    // (of an indexed directory, the leaf its hash points to)
+    int lblk = dir_hash_block(&temp_inode, hash);
+    int data_block = (lblk == -1) ? -1 : bmap(&temp_inode, lblk, NULL);
+    if (data_block < 0) {
+        return -EIO;
+    }
+
+    if (data_block >= data_block_start) {  // NOTE: a directory without any dirents may have no block
+        // look at its records in place
+        const char *dir_block = cache_get(data_block);
+        if (dir_block == NULL) {
+            return -EIO;
+        }
+
+        // if the name matches, then copy directory entry to dirent structure
+        int off = leaf_find(dir_block, fname, name_len);
+        if (off != -1) {
+            const dir_rec_t *rec = dir_rec(dir_block, off);
+            memset(dirent, 0, sizeof(dirent_t));
+            dirent->ino = rec->ino;
+            dirent->valid = 1;
+            dirent->len = rec->name_len;
+            memcpy(dirent->name, rec + 1, rec->name_len);
+            cache_put(data_block);
+            dcache_enter(ino, fname, name_len, hash, dirent->ino);
+            return 0;
+        }
+        cache_put(data_block);
+    }
+
+    // no matching exists (and remember that it doesn't)
+    dcache_enter(ino, fname, name_len, hash, -1);
+    return -ENOENT;
+}
+
+int dir_find(uint32_t ino, const char *fname, size_t name_len, struct dirent *dirent) {
+    return dir_lookup(ino, fname, name_len, name_hash(fname, name_len), dirent);
+}
+
+static int dir_add_dirent(struct inode dir_inode, uint32_t f_ino, const char *fname, size_t name_len) {
+    /*
+            1. check to see if the dirent we want to add already exists
+            2a. if it does not, add a record for it to the directory's block
+            2b. if there is no room left there, the directory gets an index, and the record goes into its leaf
+    */
+    if (name_len == 0 || name_len > DIR_NAME_MAX) {
+        return EXIT_FAILURE;
+    }
+
+    // an indexed directory only has to look at the one leaf the name hashes to
+    if (dir_inode.flags & INODE_INDEXED) {
+        return dx_add(&dir_inode, f_ino, fname, name_len);
+    }
+
+    // Step 1: Read dir_inode's data block, a new directory gets it now (in its inode's block group)
+    int data_block = bmap(&dir_inode, 0, NULL);
+    if (data_block < 0) {
+        return EXIT_FAILURE;
+    }
+    if (data_block == 0) {
+        data_block = get_avail_blkno(inode_data_goal(dir_inode.ino));
+        if (data_block == -1) {
+            return EXIT_FAILURE;  // disk full, make_node() answers ENOSPC
+        }
+        if (bmap_insert(&dir_inode, 0, data_block, 1) != EXIT_SUCCESS) {
+            release_blkno(data_block);
+            return EXIT_FAILURE;
+        }
+
+        // the new data block starts out empty (it may hold a freed block's old contents on disk)
+        leaf_init(buff_mem);
+    } else if (cache_read(data_block, buff_mem) < 0) {
+        return EXIT_FAILURE;
+    }
+
+    // Step 2: Check if fname (directory name) is already used in other entries
+    if (leaf_find(buff_mem, fname, name_len) != -1) {
+        return EXIT_FAILURE;
+    }
+
+    // Step 3: Add the record to the block and write it back, once the block is full the
+    // directory gets an index
+    if (leaf_insert(buff_mem, f_ino, fname, name_len) != EXIT_SUCCESS) {
+        if (dx_convert(&dir_inode) != EXIT_SUCCESS) {
+            return EXIT_FAILURE;
+        }
+        return dx_add(&dir_inode, f_ino, fname, name_len);
+    }
+    if (cache_write(data_block, buff_mem) < 0) {
+        return EXIT_FAILURE;
+    }
+    memset(buff_mem, 0, BUFF_MEM_SIZE);
+
+    // Step 4: update directory inode, and write it back to its slot of the inode table
+    dir_inode.size += DIR_REC_SIZE(name_len);
+    dir_inode.link += 1;
+    dir_inode.mtime = dir_inode.ctime = now_ns();
+    return writei(dir_inode.ino, &dir_inode);
+}
+
+/*
+ * Add a dirent for a name to a directory, and to the dentry cache
+ */
+int dir_add(struct inode dir_inode, uint32_t f_ino, const char *fname, size_t name_len) {
+    if (dir_add_dirent(dir_inode, f_ino, fname, name_len) != EXIT_SUCCESS) {
+        return EXIT_FAILURE;
+    }
+
+    dcache_enter(dir_inode.ino, fname, name_len, name_hash(fname, name_len), f_ino);
+    return EXIT_SUCCESS;
+}
+
+int dir_remove(struct inode dir_inode, const char *fname, size_t name_len) {
+    // Step 1: Read the data block of dir_inode the name can be in (of an indexed directory,
+    // the leaf its hash points to) and look for its directory entry
+    uint32_t hash = name_hash(fname, name_len);
+    int lblk = dir_hash_block(&dir_inode, hash);
+    int data_block = (lblk == -1) ? -1 : bmap(&dir_inode, lblk, NULL);
+    if (data_block < data_block_start) {
+        return -EXIT_FAILURE;
+    }
+
+    memset(buff_mem, 0, BUFF_MEM_SIZE);
+    if (cache_read(data_block, buff_mem) < 0) {
+        return -EXIT_FAILURE;
+    }
+
+    int off = leaf_find(buff_mem, fname, name_len);
+    if (off == -1) {
+        return -EXIT_FAILURE;
+    }
+
+    // Step 2: If exist, then remove its record from the block and write the block back
+    // (the block itself stays with the directory, its other entries are still in use)
+    leaf_remove(buff_mem, off);
+    if (cache_write(data_block, buff_mem) < 0) {
+        return -EXIT_FAILURE;
+    }
+    memset(buff_mem, 0, BUFF_MEM_SIZE);
+    dcache_enter(dir_inode.ino, fname, name_len, hash, -1);
+    dir_gen_bump(dir_inode.ino);
+
+    // Step 3: update directory inode's stats
+    dir_inode.size -= DIR_REC_SIZE(name_len);  // update size to reflect dirent has been removed
+    dir_inode.link -= 1;                       // one less link to the directory
+    dir_inode.mtime = dir_inode.ctime = now_ns();
 
-                    // if it does exist, remove it from this data block, then write to disk:
-                    
-                    // memset the target position to 0 (clear it)
-                    memset(buff_mem + j, 0, sizeof(dirent_t));
+    if (writei(dir_inode.ino, &dir_inode) != EXIT_SUCCESS) {
+        return -EXIT_FAILURE;
+    }
+
+    return EXIT_SUCCESS;
+}
+
+/*
+ * the pending data of an inode (delalloc_lock held), NULL if it has none
+ */
+static delalloc_t *delalloc_find(int ino) {
+    for (delalloc_t *d = delalloc_list; d != NULL; d = d->next) {
+        if (d->ino == ino) {
+            return d;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * the pending contents of block slot of an inode (delalloc_lock held),
+ * created zero filled if create is set and there is a block left to reserve for it
+ * (besides the ones kept for mapping blocks)
+ */
+static char *delalloc_block(int ino, int slot, int create) {
+    delalloc_t *d = delalloc_find(ino);
+    if (d != NULL && slot < d->nslots && d->data[slot] != NULL) {
+        return d->data[slot];
+    }
+    if (!create || unreserved_blocks() <= DELALLOC_META_BLOCKS) {
+        return NULL;
+    }
+
+    if (d == NULL) {
+        d = calloc(1, sizeof(delalloc_t));
+        if (d == NULL) {
+            return NULL;
+        }
+        d->ino = ino;
+
+        // oldest first, so files are laid out on disk in the order they were written
+        delalloc_t **tail = &delalloc_list;
+        while (*tail != NULL) {
+            tail = &(*tail)->next;
+        }
+        *tail = d;
+    }
+    if (slot >= d->nslots) {
+        int nslots = (slot + 1 > 2 * d->nslots) ? slot + 1 : 2 * d->nslots;
+        char **data = realloc(d->data, nslots * sizeof(char *));
+        if (data == NULL) {
+            return NULL;
+        }
+        memset(data + d->nslots, 0, (nslots - d->nslots) * sizeof(char *));
+        d->data = data;
+        d->nslots = nslots;
+    }
+    d->data[slot] = calloc(1, BLOCK_SIZE);
+    if (d->data[slot] != NULL) {
+        __atomic_add_fetch(&delalloc_blocks, 1, __ATOMIC_RELAXED);
+    }
+    return d->data[slot];
+}
+
+static void delalloc_unlink(delalloc_t *d) {
+    for (delalloc_t **p = &delalloc_list; *p != NULL; p = &(*p)->next) {
+        if (*p == d) {
+            *p = d->next;
+            break;
+        }
+    }
+    free(d->data);
+    free(d);
+}
+
+/*
+ * Allocate and write the pending blocks of one inode (delalloc_lock held):
+ * each stretch of pending blocks is asked for as one run, starting right after
+ * the file's block before it (or in the inode's block group), and the inode is
+ * written once at the end
+ */
+static int delalloc_place(delalloc_t *d) {
+    // the block pointers are filled in on the cached inode itself
+    inode_t *inode = iget(d->ino);
+    if (inode == NULL) {
+        return EXIT_FAILURE;
+    }
 
-                    // write the data block back to disk
-                    if (bio_write(data_block, buff_mem) < 0) {
-                        return -EXIT_FAILURE;
-                    }
+    int ret_stat = EXIT_SUCCESS;
+    for (int i = 0; i < d->nslots; i++) {
+        if (d->data[i] == NULL) {
+            continue;
+        }
 
-                    // update the dir_inode stats
-                    memset(buff_mem, 0, BUFF_MEM_SIZE);
+        int want = 1;
+        while (i + want < d->nslots && d->data[i + want] != NULL) {
+            want++;
+        }
+        int prev_block = (i > 0) ? bmap(inode, i - 1, NULL) : 0;
+        int goal = (prev_block >= data_block_start) ? prev_block + 1 : inode_data_goal(d->ino);
+
+        int got;
+        int run = alloc_blocks(goal, want, &got);
+        if (run == -1) {
+            ret_stat = EXIT_FAILURE;
+            break;
+        }
 
-                    // read the inode block where dir_inode exists
-                    if (bio_read(inode_block_num, buff_mem) < 0) {
-                        return -EXIT_FAILURE;
-                    }
+        // the run has its blocks now, so its reservation goes before it is mapped (any block
+        // the mapping itself needs comes out of what is left), and the blocks are only
+        // mapped once the data is written: if either fails they go back, and the data
+        // stays pending, reserved again
+        __atomic_sub_fetch(&delalloc_blocks, got, __ATOMIC_RELAXED);
+        int placed = 1;
+        for (int j = 0; j < got && placed; j++) {
+            placed = (cache_write(run + j, d->data[i + j]) >= 0);
+        }
+        if (!placed || bmap_insert(inode, i, run, got) != EXIT_SUCCESS) {
+            for (int j = 0; j < got; j++) {
+                release_blkno(run + j);
+            }
+            __atomic_add_fetch(&delalloc_blocks, got, __ATOMIC_RELAXED);
+            ret_stat = EXIT_FAILURE;
+            break;
+        }
+        for (int j = 0; j < got; j++) {
+            free(d->data[i + j]);
+            d->data[i + j] = NULL;
+        }
+        i += got - 1;
+    }
 
-                    // update directory inode's stats
-                    dir_inode.size              -= sizeof(dirent_t);    // update size to reflect dirent has been removed
-                    dir_inode.direct_ptr[i]     = 0;                    // clear direct pointer
-                    dir_inode.link              -= 1;                   // one less link to the directory (I believe?)
-                    dir_inode.vstat.st_nlink    -= 1;                       
-                    dir_inode.vstat.st_mtime    = time(NULL);           // update modification time
-                    dir_inode.vstat.st_atime    = time(NULL);           // update access time
-                    dir_inode.vstat.st_size     -= sizeof(dirent_t);
+    if (writei(d->ino, inode) != EXIT_SUCCESS) {
+        ret_stat = EXIT_FAILURE;
+    }
+    iput(inode);
+    if (ret_stat == EXIT_SUCCESS) {
+        delalloc_unlink(d);
+    }
+    return ret_stat;
+}
 
-                    // // copy this updated local inode to where the inode lives in the inode block
-                    // // NOTE: buff_mem holds the inode block of dir_inode here
-                    // memcpy(buff_mem + (offset_in_block * sizeof(inode_t)), &dir_inode, sizeof(inode_t));
+/*
+ * Place the pending blocks of inode ino (others 0), or of every inode but ino (others 1)
+ */
+static int delalloc_flush_which(int ino, int others) {
+    int ret_stat = EXIT_SUCCESS;
+
+    pthread_mutex_lock(&delalloc_lock);
+    delalloc_t *d = delalloc_list;
+    while (d != NULL) {
+        delalloc_t *next = d->next;
+        if ((d->ino == ino) != others && delalloc_place(d) != EXIT_SUCCESS) {
+            ret_stat = EXIT_FAILURE;
+        }
+        d = next;
+    }
+    pthread_mutex_unlock(&delalloc_lock);
 
-                    // // write this inode block back to disk
-                    // if (bio_write(inode_block_num, buff_mem) < 0) {
-                    //     return -EXIT_FAILURE;
-                    // }
+    return ret_stat;
+}
 
-                    // OR: may just be able to do:
-                    if (writei(dir_inode.ino, &dir_inode) != EXIT_SUCCESS) {
-                        return -EXIT_FAILURE;
-                    }
+static int delalloc_flush(int ino) {
+    return delalloc_flush_which(ino, 0);
+}
 
-                    printf("***********dir_remove() RETURN SUCCESS\n");
+static int delalloc_flush_all() {
+    return delalloc_flush_which(-1, 1);
+}
 
-                    return EXIT_SUCCESS;
-                }
+/*
+ * Drop the pending blocks of an inode past a new file size, and zero the cut off
+ * part of a pending last block (size 0 drops them all, the file is going away)
+ */
+static void delalloc_truncate(int ino, off_t size) {
+    pthread_mutex_lock(&delalloc_lock);
+    delalloc_t *d = delalloc_find(ino);
+    if (d != NULL) {
+        int blocks_kept = (size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+        int pending = 0;
+        for (int i = 0; i < d->nslots; i++) {
+            if (d->data[i] != NULL && i >= blocks_kept) {
+                free(d->data[i]);
+                d->data[i] = NULL;
+                __atomic_sub_fetch(&delalloc_blocks, 1, __ATOMIC_RELAXED);
             }
+            pending += (d->data[i] != NULL);
+        }
+
+        if (size % BLOCK_SIZE != 0 && blocks_kept <= d->nslots && d->data[blocks_kept - 1] != NULL) {
+            memset(d->data[blocks_kept - 1] + (size % BLOCK_SIZE), 0, BLOCK_SIZE - (size % BLOCK_SIZE));
+        }
+        if (pending == 0) {
+            delalloc_unlink(d);
         }
     }
-    printf("***********dir_remove() RETURN FAILURE\n");
-    return -EXIT_FAILURE;
+    pthread_mutex_unlock(&delalloc_lock);
 }
 
 /*
- * namei operation
+ * Move the contents a small file keeps in its inode out to a data block of its own, once
+ * they no longer fit there (the block is left pending, like any other newly written block)
  */
-int get_node_by_path(const char *path, uint16_t ino, struct inode *inode) {
-    // Step 1: Resolve the path name, walk through path, and finally, find its inode.
-    // Note: You could either implement it in a iterative way or recursive way
+static int inline_promote(inode_t *inode) {
+    int ret_stat = EXIT_SUCCESS;
+
+    // (with delalloc_lock held throughout, so the pending block can't be placed before
+    // the inode stops keeping its contents where the block pointers go)
+    pthread_mutex_lock(&delalloc_lock);
+    if (inode->size > 0) {
+        char *pending = delalloc_block(inode->ino, 0, 1);
+        if (pending == NULL) {
+            ret_stat = EXIT_FAILURE;
+        } else {
+            memcpy(pending, inode->inline_data, inode->size);
+        }
+    }
+    if (ret_stat == EXIT_SUCCESS) {
+        inode->flags &= ~INODE_INLINE_DATA;
+        bmap_init(inode);
+        ret_stat = writei(inode->ino, inode);
+    }
+    pthread_mutex_unlock(&delalloc_lock);
 
-    char **parts_of_path[1024];
+    return ret_stat;
+}
 
-    // split the input path into components and store in 'parts_of_path'
-    // save the number of components in 'termination_count'
-    // --> this indicates how many times we need to run the loop until we reach the terminal point
-    int termination_count = num_of_components(path, parts_of_path);
+/*
+ * Free all the data blocks of an inode and then the inode itself
+ */
+static int release_inode(inode_t *inode) {
+    delalloc_truncate(inode->ino, 0);
 
-    inode_t temp_inode;
-    inode_t res_inode;
-    dirent_t temp_dirent;
+    // (a small file kept in its inode has no blocks to free)
+    if (!(inode->flags & INODE_INLINE_DATA) && bmap_truncate(inode, 0) != EXIT_SUCCESS) {
+        return EXIT_FAILURE;
+    }
 
-    if (termination_count == -1) {
-        // indicate something went wrong
+    memset(inode->inline_data, 0, INLINE_DATA_SIZE);
+    inode->flags = 0;
+    inode->valid = 0;
+    inode->size = 0;
+    inode->link = 0;
+    if (writei(inode->ino, inode) != EXIT_SUCCESS) {
         return EXIT_FAILURE;
-    } else if (termination_count == 0) {
-        // the path must be the root directory '/'
+    }
 
-        /* from the rufs_mkfs() we know root dir has inode of 0, since we made it that way*/
-        /* so then read the root inode and return*/
+    return release_ino(inode->ino);
+}
 
-        int ret_stat = readi(root_inode, &temp_inode);
-        if (ret_stat == EXIT_FAILURE) {
-            return EXIT_FAILURE;
-        }
+/*
+ * Step a cursor into a path on to its next component (any number of '/'s separate them),
+ * and describe the component in *comp. returns 0 once the path has no more components
+ */
+int path_next(const char **cursor, path_comp_t *comp) {
+    const char *p = *cursor;
+    while (*p == '/') {
+        p++;
+    }
+    if (*p == '\0') {
+        *cursor = p;
+        return 0;
+    }
 
-        *inode = temp_inode;
+    const char *end = p;
+    while (*end != '/' && *end != '\0') {
+        end++;
+    }
+    comp->name = p;
+    comp->len = end - p;
+    comp->hash = name_hash(p, comp->len);
+    *cursor = end;
+    return 1;
+}
 
+/*
+ * namei operation
+ */
+int get_node_by_path(const char *path, uint32_t ino, struct inode *inode) {
+    // Step 0: The path cache may already know where the whole path leads
+    // (it only has paths from the root)
+    size_t path_len = strlen(path);
+    uint32_t path_hash = name_hash(path, path_len);
+    int cached_ino;
+    if (ino == root_inode && pcache_lookup(path, path_len, path_hash, &cached_ino) && readi(cached_ino, inode) == EXIT_SUCCESS) {
         return EXIT_SUCCESS;
     }
 
-    // else, if the path needs traversing... traverse it:
+    // Step 1: Resolve the path name, walk through path, and finally, find its inode.
+    // (the components are looked at in place, each one looked up with the hash path_next() gives it)
+    if (path_len == 0) {
+        return EXIT_FAILURE;
+    }
+
     int inode_for_search = ino;  // should contain root inode at first go
-    int ret_stat;
-    for (int i = 0; i < termination_count; i++) {
-        // search to see if each part of the path exists
+    const char *cursor = path;
+    path_comp_t comp;
+    dirent_t temp_dirent;
+    int dirs[PCACHE_DEPTH];
+    uint32_t gens[PCACHE_DEPTH];
+    int depth = 0;
+    while (path_next(&cursor, &comp)) {
+        // note each directory's generation before looking into it, for the path cache
+        if (depth < PCACHE_DEPTH) {
+            dirs[depth] = inode_for_search;
+            gens[depth] = dir_gen(inode_for_search);
+        }
+        depth++;
 
-        ret_stat = dir_find(inode_for_search, parts_of_path[i], strlen(parts_of_path[i]), &temp_dirent);
-        if (ret_stat == EXIT_FAILURE) {
+        // search to see if each part of the path exists
+        if (dir_lookup(inode_for_search, comp.name, comp.len, comp.hash, &temp_dirent) != EXIT_SUCCESS) {
             return EXIT_FAILURE;
         }
 
@@ -653,18 +3142,43 @@ int get_node_by_path(const char *path, uint16_t ino, struct inode *inode) {
         inode_for_search = temp_dirent.ino;
     }
 
-    /*
-            once the termination point is reached temp_dirent should contain its inode,
-            so read its inode into temp_inode then return it
-    */
-    int read_ret_stat = readi(temp_dirent.ino, &temp_inode);
-    if (read_ret_stat == EXIT_FAILURE) {
+    // Step 2: once the termination point is reached, read its inode and return it
+    if (readi(inode_for_search, inode) != EXIT_SUCCESS) {
         return EXIT_FAILURE;
     }
+    if (ino == root_inode && depth > 0) {
+        pcache_enter(path, path_len, path_hash, depth, dirs, gens, inode_for_search);
+    }
+    return EXIT_SUCCESS;
+}
 
-    *inode = temp_inode;
+/*
+ * Fit as many block groups as the open disk has room for (up to MAX_GROUPS) into the superblock:
+ * every group but the last is full size, the last one gets the data blocks that are left
+ * after its bitmaps
+ */
+static void fit_block_groups() {
+    long disk_blocks = dev_size() / BLOCK_SIZE;
+    int meta_blocks = superblock.blocks_per_group - superblock.data_per_group;
+
+    int groups = 0;
+    int data_blocks = 0;
+    while (groups < MAX_GROUPS) {
+        long left = disk_blocks - group_blkno(groups, i_bitmap_index) - meta_blocks;
+        if (left <= 0) {
+            break;
+        }
+        groups++;
+        if (left < superblock.data_per_group) {
+            data_blocks += left;
+            break;
+        }
+        data_blocks += superblock.data_per_group;
+    }
 
-    return EXIT_SUCCESS;
+    superblock.groups = groups;
+    superblock.max_inum = groups * superblock.inodes_per_group;
+    superblock.max_dnum = data_blocks;
 }
 
 /*
@@ -673,7 +3187,7 @@ int get_node_by_path(const char *path, uint16_t ino, struct inode *inode) {
 int rufs_mkfs() {
     if (atomic_flag_test_and_set(&init) == 0) {
         // create a buffer memory to hold intermediate values between read and writes
-        buff_mem = (char *)malloc(BUFF_MEM_SIZE);
+        buff_mem = (char *)bio_alloc(BUFF_MEM_SIZE);  // aligned, for O_DIRECT
         if (!buff_mem) {
             perror("Failed to allocate memory for buff_mem");
             return EXIT_FAILURE;
@@ -683,23 +3197,22 @@ int rufs_mkfs() {
         // Call dev_init() to initialize (Create) Diskfile
         dev_init(diskfile_path);
 
-        // set up local variables
+        // set up local variables (where group 0's blocks are, the other groups follow it)
         superblock_index = 0;
         i_bitmap_index = 1;
         d_bitmap_index = 2;
         /*
                 calculate how many inodes fit in 1 block
-                (w/ 4KB blocks and the inode struct given to us, there should be 16 inodes in 1 block)
+                (w/ 4KB blocks and 128 byte inodes, there should be 32 inodes in 1 block)
         */
         inodes_in_block = (BLOCK_SIZE / sizeof(inode_t));
         /*
-                calculate how many blocks are needed for the inode table
-                (w/ 16 inodes per block, and a total of 1024 inodes
-                ==> 1024/16 = 64 block for inodes)
+                the inode tables take no room of their own: each chunk of INODES_PER_CHUNK
+                inodes is allocated from the data blocks when its first inode is
+                (w/ 32 inodes per block, and 256 inodes per chunk
+                ==> 256/32 = 8 blocks per chunk)
         */
-        int inode_table_size = (MAX_INUM / inodes_in_block);  // = 64 blocks
-        inode_table_index = 3;
-        data_block_start = (inode_table_size + inode_table_index);  // also serves as end of inode table
+        data_block_start = 3;
 
         /*
                 read the first block of disk and store into buff_mem
@@ -709,98 +3222,87 @@ int rufs_mkfs() {
         // write superblock information
         memset(&superblock, 0, sizeof(superblock_t));
         superblock.magic_num = MAGIC_NUM;
-        superblock.max_inum = MAX_INUM;
-        superblock.max_dnum = MAX_DNUM;
+        superblock.version = RUFS_VERSION;
+        superblock.features = config.use_blockmap ? FEATURE_BLOCKMAP : 0;
         superblock.i_bitmap_blk = i_bitmap_index;
         superblock.d_bitmap_blk = d_bitmap_index;
-        superblock.i_start_blk = inode_table_index;
         superblock.d_start_blk = data_block_start;
+        superblock.inodes_per_group = INODES_PER_GROUP;
+        superblock.data_per_group = DATA_BLOCKS_PER_GROUP;
+        superblock.blocks_per_group = (data_block_start - i_bitmap_index) + DATA_BLOCKS_PER_GROUP;
+        fit_block_groups();
 
-        // copy superblock to buffer, then write to disk
-        memcpy(buff_mem, &superblock, sizeof(superblock_t));
-        int write_ret_stat = bio_write(superblock_index, buff_mem);
-        if (write_ret_stat < 0) {
+        // initialize i_bitmap and d_bitmap
+        memset(i_bitmap, 0, I_BITMAP_SIZE);
+        memset(d_bitmap, 0, D_BITMAP_SIZE);
+        if (setup_alloc_groups() != EXIT_SUCCESS) {
+            perror("Failed to allocate memory for the free extents");
             return EXIT_FAILURE;
         }
-        memset(buff_mem, 0, BUFF_MEM_SIZE);  // clear the buffer
 
-        // initialize i_bitmap
-        memset(i_bitmap, 0, I_BITMAP_SIZE);
-        // copy i_bitmap to the buffer then write buffer to disk
-        memcpy(buff_mem, i_bitmap, I_BITMAP_SIZE);
-        write_ret_stat = bio_write(i_bitmap_index, buff_mem);
-        if (write_ret_stat < 0) {
+        /*
+                every group starts with both its bitmaps as consecutive blocks, so each group's
+                are written with a single vectored write (group 0's right after the superblock,
+                in the same one)
+        */
+        int meta_blocks = data_block_start - i_bitmap_index;
+        char *meta_buf = bio_alloc((1 + meta_blocks) * BLOCK_SIZE);
+        if (!meta_buf) {
+            perror("Failed to allocate memory for the metadata blocks");
             return EXIT_FAILURE;
         }
-        memset(buff_mem, 0, BUFF_MEM_SIZE);
-
-        // initialize d_bitmap
-        memset(d_bitmap, 0, D_BITMAP_SIZE);
-
-        // copy d_bitmap to the buffer then write buffer to disk
-        memcpy(buff_mem, d_bitmap, D_BITMAP_SIZE);
-        write_ret_stat = bio_write(d_bitmap_index, buff_mem);
+        memset(meta_buf, 0, (1 + meta_blocks) * BLOCK_SIZE);
+        memcpy(meta_buf + (superblock_index * BLOCK_SIZE), &superblock, sizeof(superblock_t));
+
+        int write_ret_stat = 0;
+        for (int g = 0; g < superblock.groups && write_ret_stat >= 0; g++) {
+            struct iovec meta_iov = {
+                .iov_base = (g == 0) ? meta_buf : (meta_buf + BLOCK_SIZE),
+                .iov_len = (g == 0) ? ((1 + meta_blocks) * BLOCK_SIZE) : (meta_blocks * BLOCK_SIZE)};
+            write_ret_stat = bio_writev((g == 0) ? superblock_index : group_blkno(g, i_bitmap_index), &meta_iov, 1);
+        }
+        free(meta_buf);
         if (write_ret_stat < 0) {
             return EXIT_FAILURE;
         }
-        memset(buff_mem, 0, BUFF_MEM_SIZE);
 
         // update bitmap information for root directory
+        // (which gives group 0 the first chunk of its inode table)
 
-        root_inode = get_avail_ino();
+        root_inode = get_avail_ino(0);
+        if (root_inode == -1) {
+            return EXIT_FAILURE;
+        }
 
         // create inode for root directory
         inode_t local_root_inode = {
             .ino = root_inode,         // inode # for root directory is 0
             .valid = 1,                // not sure what to set this to yet, so I set to 1 for now to indicate its in use
-            .size = sizeof(dirent_t),  // keep track of the size of the root dir
+            .size = 0,                 // no dirents yet
             .type = __S_IFDIR | 0755,  // set file type and permissions
             .link = 2,                 // . and .. are the links for the root
-            .direct_ptr = {0},         // nothing for now, then update once dirent is created and linked
-            .indirect_ptr = {0},
-            .vstat = {
-                .st_mtime = time(NULL),  // clock the make time of the root dir
-                .st_atime = time(NULL),  // clock the access time of the root dir
-                .st_nlink = 2}};
-
-        local_root_inode.direct_ptr[0] = get_avail_blkno();
+            .version = RUFS_VERSION,
+            .uid = getuid(),
+            .gid = getgid(),
+            .atime = now_ns(),         // clock the make time of the root dir
+            .mtime = now_ns(),
+            .ctime = now_ns()};
+
+        // (its first block holds its dirents)
+        bmap_init(&local_root_inode);
+        int root_block = get_avail_blkno(data_block_start);
+        if (root_block == -1 || bmap_insert(&local_root_inode, 0, root_block, 1) != EXIT_SUCCESS) {
+            return EXIT_FAILURE;
+        }
 
-        // copy this inode into the buffer
-        memset(buff_mem, 0, BUFF_MEM_SIZE);
-        memcpy(buff_mem, &local_root_inode, sizeof(inode_t));
-        // write buffer to disk
-        write_ret_stat = bio_write(inode_table_index, buff_mem);
-        if (write_ret_stat < 0) {
+        // write it to its chunk of the inode table (with the next flush)
+        if (writei(root_inode, &local_root_inode) != EXIT_SUCCESS) {
             return EXIT_FAILURE;
         }
-        memset(buff_mem, 0, BUFF_MEM_SIZE);
 
-        // create dirent for root directory
-        dirent_t root_dirent_1 = {
-            .ino = 0,
-            .valid = 1,
-            .name = "/",
-            .len = 1};
-
-        dirent_t root_dirent_2 = {
-            .ino = 0,
-            .valid = 1,
-            .name = ".",
-            .len = 1};
-
-        dirent_t root_dirent_3 = {
-            .ino = 0,
-            .valid = 1,
-            .name = "..",
-            .len = 2};
-
-        // copy the dirent created to the buffer:
-        memcpy(buff_mem, &root_dirent_1, sizeof(dirent_t));
-        memcpy(buff_mem + sizeof(dirent_t), &root_dirent_2, sizeof(dirent_t));
-        memcpy(buff_mem + (2 * sizeof(dirent_t)), &root_dirent_3, sizeof(dirent_t));
-
-        // write buffer to disk at block 67 (which is data block 0)
-        write_ret_stat = bio_write(local_root_inode.direct_ptr[0], buff_mem);
+        // and its block, without any dirents yet
+        leaf_init(buff_mem);
+        write_ret_stat = cache_write(root_block, buff_mem);
         if (write_ret_stat < 0) {
             return EXIT_FAILURE;
         }
@@ -810,22 +3312,45 @@ int rufs_mkfs() {
     return 0;
 }
 
+/*
+ * init can't fail a mount, and nothing works without what it sets up (a superblock that
+ * was never read would have every request divide by zero), so the daemon stops instead
+ */
+static void *mount_failed(const char *why) {
+    fprintf(stderr, "rufs: %s: %s\n", diskfile_path, why);
+    exit(EXIT_FAILURE);
+}
+
 /*
  * FUSE file operations
  */
 static void *my_init(struct fuse_conn_info *conn) {
+    // Step 0: Set up the block cache every block access goes through
+    dev_set_backend(config.use_mmap ? BIO_BACKEND_MMAP : BIO_BACKEND_PREAD);
+    dev_set_direct(config.use_odirect);
+    dev_set_size((off_t)config.disk_size * 1024 * 1024);
+    if (cache_init((size_t)config.cache_size * 1024) < 0) {
+        return mount_failed("can't set up the block cache");
+    }
+    icache_init();
+    dcache_init();
+    if (pcache_init(config.path_cache) != EXIT_SUCCESS) {
+        return mount_failed("can't set up the path cache");
+    }
+
     // Step 1a: If disk file is not found, call mkfs
     int disk = dev_open(diskfile_path);
     if (disk == -1) {
-        rufs_mkfs();
+        if (rufs_mkfs() != EXIT_SUCCESS) {
+            return mount_failed("can't make a new file system");
+        }
     } else {
         // Step 1b: If disk file is found, just initialize in-memory data structures
         // and read superblock from disk
 
-        buff_mem = (char *)malloc(BUFF_MEM_SIZE);
+        buff_mem = (char *)bio_alloc(BUFF_MEM_SIZE);  // aligned, for O_DIRECT
         if (!buff_mem) {
-            perror("Failed to allocate memory for buff_mem");
-            return EXIT_FAILURE;
+            return mount_failed("can't allocate buff_mem");
         }
 
         memset(buff_mem, 0, BUFF_MEM_SIZE);
@@ -835,33 +3360,90 @@ static void *my_init(struct fuse_conn_info *conn) {
         i_bitmap_index = 1;
         d_bitmap_index = 2;
 
-        if (bio_read(superblock_index, buff_mem) < 0) {
-            return EXIT_FAILURE;
+        if (cache_read(superblock_index, buff_mem) < 0) {
+            return mount_failed("can't read the superblock");
         }
         // Now we've read the superblock into memory
 
-        superblock_t *casted_superblock = (superblock_t *)buff_mem;
-        i_bitmap_index = casted_superblock->i_bitmap_blk;
-        d_bitmap_index = casted_superblock->d_bitmap_blk;
+        memcpy(&superblock, buff_mem, sizeof(superblock_t));
+        if (superblock.magic_num != MAGIC_NUM || superblock.version != RUFS_VERSION) {
+            fprintf(stderr, "rufs: %s is not a rufs disk of version %d\n", diskfile_path, RUFS_VERSION);
+            exit(EXIT_FAILURE);
+        }
+        i_bitmap_index = superblock.i_bitmap_blk;
+        d_bitmap_index = superblock.d_bitmap_blk;
 
-        inode_table_index = casted_superblock->i_start_blk;
-        data_block_start = casted_superblock->d_start_blk;
+        data_block_start = superblock.d_start_blk;
 
         inodes_in_block = (BLOCK_SIZE / sizeof(inode_t));
-        int inode_table_size = (MAX_INUM / inodes_in_block);  // = 64 blocks
+
+        // Step 1c: Keep both bitmaps in memory from now on
+        if (load_bitmaps() != EXIT_SUCCESS) {
+            return mount_failed("can't read the bitmaps");
+        }
+
+        // Step 1d: If the disk was grown (-o disk_size), fill up the last block group and add new ones
+        // (the disk file was grown with zeros, so their bitmaps start out empty, and their
+        // inode tables have no chunks yet)
+        superblock_t on_disk = superblock;
+        fit_block_groups();
+        if (superblock.max_dnum <= on_disk.max_dnum) {
+            superblock = on_disk;
+        } else {
+            superblock_dirty = 1;
+            if (sync_superblock() != EXIT_SUCCESS) {
+                return mount_failed("can't write the grown superblock");
+            }
+        }
+        memset(buff_mem, 0, BUFF_MEM_SIZE);
+
+        // Step 1e: Split the bitmaps into allocation groups, with the free bits of the
+        // data bitmap turned into free extents to allocate runs from
+        if (setup_alloc_groups() != EXIT_SUCCESS) {
+            return mount_failed("can't set up the allocation groups");
+        }
     }
 
     return NULL;
 }
 
 static void my_destroy(void *userdata) {
-    // Step 1: De-allocate in-memory data structures
+    // Step 1: Place pending data, write back dirty blocks, then de-allocate in-memory data structures
+    delalloc_flush_all();
+    punch_freed_blocks();
+    sync_bitmaps();
+    icache_flush();
+    cache_flush();
+    cache_destroy();
+    free_alloc_groups();
+    pcache_destroy();
     free(buff_mem);
 
     // Step 2: Close diskfile
     dev_close();
 }
 
+/*
+ * Fill a struct stat with the attributes of an inode
+ * (the on-disk inode keeps only what rufs needs, this is the one place it becomes a struct stat)
+ */
+static void inode_stat(const inode_t *inode, struct stat *stbuf) {
+    memset(stbuf, 0, sizeof(struct stat));
+    stbuf->st_ino = inode->ino;                     // inode number
+    stbuf->st_uid = inode->uid;                     // user ID of owner
+    stbuf->st_gid = inode->gid;                     // group ID of owner
+    stbuf->st_nlink = inode->link;                  // number of links
+    stbuf->st_size = inode->size;                   // size of the file
+    stbuf->st_blksize = BLOCK_SIZE;
+    if (!(inode->flags & INODE_INLINE_DATA)) {
+        stbuf->st_blocks = ((inode->size + BLOCK_SIZE - 1) / BLOCK_SIZE) * (BLOCK_SIZE / 512);
+    }
+    stbuf->st_ctim = ns_to_timespec(inode->ctime);  // last status change time
+    stbuf->st_atim = ns_to_timespec(inode->atime);  // last access time
+    stbuf->st_mtim = ns_to_timespec(inode->mtime);  // last modification time
+    stbuf->st_mode = inode->type;                   // type of file
+}
+
 static int my_getattr(const char *path, struct stat *stbuf) {
     // Step 1: call get_node_by_path() to get inode from path
     inode_t path_node;
@@ -874,14 +3456,7 @@ static int my_getattr(const char *path, struct stat *stbuf) {
     }
 
     // Step 2: fill attribute of file into stbuf from inode
-    stbuf->st_uid = getuid();                    // user ID of owner
-    stbuf->st_gid = getgid();                    // group ID of owner
-    stbuf->st_nlink = path_node.link;            // number of links
-    stbuf->st_size = path_node.size;             // size of the file
-    stbuf->st_ctime = path_node.vstat.st_ctime;  // creation time
-    stbuf->st_atime = path_node.vstat.st_atime;  // last access time
-    stbuf->st_mtime = path_node.vstat.st_mtime;  // last modification time
-    stbuf->st_mode = path_node.type;             // type of file
+    inode_stat(&path_node, stbuf);
 
     return 0;  // Success
 }
@@ -905,175 +3480,279 @@ static int my_opendir(const char *path, struct fuse_file_info *fi) {
     return 0;
 }
 
-static int my_readdir(const char *path, void *buffer, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi) {
-
-    printf("***************my_readdir() START\n");
-
-    // Call get_node_by_path() to get inode from path
-    inode_t dir_inode;
-
-    printf("***************my_readdir() calling get_node_by_path()\n");
-    int get_node_result = get_node_by_path(path, root_inode, &dir_inode);
-    printf("***************my_readdir() returned from get_node_by_path()\n");
-
-    if (get_node_result == EXIT_FAILURE) {
-        return EXIT_FAILURE;
+/*
+ * readdir lists a directory in hash order (the names of each leaf sorted by hash, the leaves
+ * in the order they are chained), so how far a listing got can be told by a cookie that stays
+ * valid whatever is added or removed in between, and however the leaves split: the hash of the
+ * name listed last, and which of the names with that hash it was in name order. Cookies start
+ * at 1, offset 0 is the start of the directory.
+ */
+#define DIR_COOKIE(hash, idx) ((off_t)(((uint64_t)(hash) << 16) | (idx)) + 1)
+#define DIR_COOKIE_HASH(cookie) ((uint32_t)(((cookie) - 1) >> 16))
+
+typedef struct readdir_ent {
+    uint32_t hash;
+    uint32_t idx;  // among the names with the same hash
+    const dir_rec_t *rec;
+} readdir_ent_t;
+
+static int compare_readdir_ent(const void *a, const void *b) {
+    const readdir_ent_t *x = a;
+    const readdir_ent_t *y = b;
+    if (x->hash != y->hash) {
+        return (x->hash > y->hash) - (x->hash < y->hash);
     }
+    int len = (x->rec->name_len < y->rec->name_len) ? x->rec->name_len : y->rec->name_len;
+    int cmp = memcmp(x->rec + 1, y->rec + 1, len);
+    return (cmp != 0) ? cmp : x->rec->name_len - y->rec->name_len;
+}
 
-    // Instantiate buffer
-    dirent_t all_dirents[dir_inode.link];
-    dirent_t current_dirent;
-    printf("***************my_readdir() dir_inode.link = %d\n", dir_inode.link);
+/*
+ * Pass filler the names of a directory block that come after the cookie offset, with their
+ * attributes (the inode table blocks holding their inodes are read in one batch first).
+ * returns 1 once filler's buffer is full, 0 when the whole block has been listed
+ */
+static int readdir_block(const char *block, off_t offset, void *buffer, fuse_fill_dir_t filler) {
+    // Step 1: Sort the names of the block into listing order, leaving out the ones listed already
+    readdir_ent_t ents[DIR_BLOCK_SPACE / sizeof(dir_rec_t)];
+    int n = 0;
+    for (int off = 0; off != -1; off = leaf_next(block, off)) {
+        const dir_rec_t *rec = dir_rec(block, off);
+        if (rec->name_len != 0) {
+            ents[n].hash = name_hash((const char *)(rec + 1), rec->name_len);
+            ents[n++].rec = rec;
+        }
+    }
+    qsort(ents, n, sizeof(readdir_ent_t), compare_readdir_ent);
 
-    /* special case for empty root dir: */
-    if (dir_inode.link == 2 && dir_inode.ino == root_inode) {
-        printf("***************my_readdir() found root node with only two links (empty)\n");
-        return 0;
+    int m = 0;
+    for (int i = 0; i < n; i++) {
+        ents[i].idx = (i > 0 && ents[i].hash == ents[i - 1].hash) ? ents[i - 1].idx + 1 : 0;
+        if (DIR_COOKIE(ents[i].hash, ents[i].idx) > offset) {
+            ents[m++] = ents[i];
+        }
     }
 
+    // Step 2: Bring the inode table blocks of their inodes into the cache together
+    int blocks[DIR_BLOCK_SPACE / sizeof(dir_rec_t)];
+    for (int i = 0; i < m; i++) {
+        blocks[i] = inode_blkno(ents[i].rec->ino);
+    }
+    cache_prefetch(blocks, m);
+
+    // Step 3: Copy each name to filler with its attributes, and the cookie to resume after it
+    for (int i = 0; i < m; i++) {
+        char name[DIR_NAME_MAX + 1];
+        memcpy(name, ents[i].rec + 1, ents[i].rec->name_len);
+        name[ents[i].rec->name_len] = '\0';
+
+        inode_t inode;
+        struct stat st;
+        if (readi(ents[i].rec->ino, &inode) == EXIT_SUCCESS) {
+            inode_stat(&inode, &st);
+        } else {
+            memset(&st, 0, sizeof(struct stat));
+            st.st_ino = ents[i].rec->ino;
+        }
+        if (filler(buffer, name, &st, DIR_COOKIE(ents[i].hash, ents[i].idx)) != 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
 
-    printf("***************my_readdir() traversing direct pointers of dir_inode.ino\n");
-    for (int i = 0; i < NUM_DIRECT_PTRS; i++) {
+/*
+ * List the names of a directory that come after the cookie offset to filler, until
+ * it is full. returns 0, or -errno
+ */
+static int dir_list(inode_t dir_inode, off_t offset, void *buffer, fuse_fill_dir_t filler) {
+    // Step 1: Find the block to start from: the one holding the names right after the cookie
+    // (of an indexed directory, the leaf its hash leads to, else its only block)
+    int lblk = dir_hash_block(&dir_inode, (offset > 0) ? DIR_COOKIE_HASH(offset) : 0);
+    if (lblk == -1) {
+        return -EIO;
+    }
+    bmap_prefetch(&dir_inode, 0, NUM_DIRECT_PTRS - 1);
 
-        int data_block = dir_inode.direct_ptr[i];
-        if (data_block >= data_block_start) {  // Check if valid
-            printf("***************my_readdir() found valid data block num: %d\n", data_block);
+    // Step 2: List its names, and those of the leaves chained after it, until filler is full
+    while (lblk != -1) {
+        int data_block = bmap(&dir_inode, lblk, NULL);
+        if (data_block < data_block_start) {  // NOTE: a directory without any dirents may have no block
+            break;
+        }
 
-            memset(buff_mem, 0, BUFF_MEM_SIZE);
-            if (bio_read(data_block, buff_mem) < 0) {
-                return EXIT_FAILURE;
-            }
-            printf("***************my_readdir() read data block %d into buff_mem\n", data_block);
+        const char *block = cache_get(data_block);
+        if (block == NULL) {
+            return -EIO;
+        }
+        int full = readdir_block(block, offset, buffer, filler);
+        uint32_t next = dir_tail(block)->next;
+        cache_put(data_block);
+        if (full) {
+            break;
+        }
+        lblk = (next != 0) ? (int)next : -1;
+    }
 
-            int last = MAX_DIRENTS_IN_BLOCK * sizeof(dirent_t);
+    return 0;
+}
 
-            printf("***************my_readdir() reading dirent positions of data block %d\n", data_block);
-            // Step 2: Read directory entries from its data blocks, and copy them to filler
-            for (int j = 0; j <= last; j += sizeof(dirent_t)) {
-                
+static int my_readdir(const char *path, void *buffer, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi) {
+    // Step 1: Call get_node_by_path() to get inode from path
+    inode_t dir_inode;
+    if (get_node_by_path(path, root_inode, &dir_inode) == EXIT_FAILURE) {
+        return -ENOENT;
+    }
 
-                memcpy(&all_dirents[j % sizeof(dirent_t)], buff_mem + j, sizeof(dirent_t));
-                dirent_t temp_dirent;
-                memset(&temp_dirent, 0, sizeof(dirent_t));
-                memcpy(&temp_dirent, buff_mem + j, sizeof(dirent_t));
+    // Step 2: List its names from the cookie on
+    return dir_list(dir_inode, offset, buffer, filler);
+}
 
-                printf("***************my_readdir() temp_dirent.name: %s, temp_dirent.ino: %d\n", temp_dirent.name, temp_dirent.ino);
+/*
+ * Make a new directory or regular file (as mode says) named fname in directory parent, owned
+ * by the user and group the request came from, and return its inode in *new_inode.
+ * returns 0, or -errno
+ */
+static int make_node(inode_t parent_dir_node, const char *fname, size_t name_len, mode_t mode, uid_t uid, gid_t gid,
+                     inode_t *new_inode) {
+    // Step 0: The name has to fit in a dirent, and not be taken already
+    dirent_t dirent;
+    if (!S_ISDIR(parent_dir_node.type)) {
+        return -ENOTDIR;
+    }
+    if (name_len > DIR_NAME_MAX) {
+        return -ENAMETOOLONG;
+    }
+    if (dir_find(parent_dir_node.ino, fname, name_len, &dirent) == EXIT_SUCCESS) {
+        return -EEXIST;
+    }
 
-                // if we found a none empty dirent add to buffer
-                if (temp_dirent.len != 0) {
-                    filler(buffer, all_dirents[j % sizeof(dirent_t)].name, NULL, offset);  
-                }
+    // Step 1: Call get_avail_ino() to get an available inode number
+    // (directories are spread over the block groups, a file goes in its parent directory's)
+    int new_ino_num = get_avail_ino(S_ISDIR(mode) ? dir_group() : ino_group(parent_dir_node.ino));
+    if (new_ino_num == -1) {
+        return -ENOSPC;
+    }
 
-                // filler(buffer, &temp_dirent.name, NULL, offset);
+    *new_inode = (inode_t){
+        .ino = new_ino_num,
+        .valid = 1,
+        .size = 0,
+        .type = mode,
+        .link = S_ISDIR(mode) ? 2 : 1,
+        .flags = S_ISDIR(mode) ? 0 : INODE_INLINE_DATA,  // a file is kept in the inode until it outgrows it
+        .version = RUFS_VERSION,
+        .uid = uid,
+        .gid = gid,
+        .atime = now_ns(),
+        .mtime = now_ns(),
+        .ctime = now_ns(),
+    };
+    if (S_ISDIR(mode)) {
+        bmap_init(new_inode);  // no blocks yet, dir_add() maps them as it needs them
+    }
 
-            }
-        }
+    // Step 2: Call dir_add() to add its directory entry to the parent directory
+    if (dir_add(parent_dir_node, new_ino_num, fname, name_len) != EXIT_SUCCESS) {
+        release_ino(new_ino_num);
+        return -ENOSPC;
     }
 
+    // Step 3: Call writei() to write the new inode to disk
+    if (writei(new_ino_num, new_inode) != EXIT_SUCCESS) {
+        return -EIO;
+    }
     return 0;
 }
 
 static int my_mkdir(const char *path, mode_t mode) {
     // Step 1: Use dirname() and basename() to separate parent directory path and target directory name
-
-    char *dirname_copy[strlen(path)];
-    char *basename_copy[strlen(path)];
+    char dirname_copy[strlen(path) + 1];
+    char basename_copy[strlen(path) + 1];
 
     strcpy(dirname_copy, path);
     strcpy(basename_copy, path);
 
-    // Step 1: Use dirname() and basename() to separate parent directory path and target file name
     char *dir_name = dirname(dirname_copy);
     char *path_name = basename(basename_copy);
 
     // Step 2: Call get_node_by_path() to get inode of parent directory
-
     inode_t parent_dir_node;
     if (get_node_by_path(dir_name, root_inode, &parent_dir_node) == EXIT_FAILURE) {
-        return EXIT_FAILURE;
+        return -ENOENT;
     }
 
-    // Step 3: Call get_avail_ino() to get an available inode number
-
-    int new_ino_num = get_avail_ino();
+    // Step 3: Make the directory in it
+    inode_t new_inode;
+    const struct fuse_context *ctx = fuse_get_context();
+    return make_node(parent_dir_node, path_name, strlen(path_name), __S_IFDIR | (mode & 07777), ctx->uid, ctx->gid, &new_inode);
+}
 
-    if (new_ino_num == -1) {
-        return EXIT_FAILURE;
+/*
+ * Remove the regular file (or with dir set, the empty directory) named fname from directory
+ * parent_ino. returns 0, or -errno
+ */
+static int remove_node(uint32_t parent_ino, const char *fname, size_t name_len, int dir) {
+    // Step 1: Call dir_find() and readi() to get the inode of the target
+    dirent_t dirent;
+    inode_t target;
+    if (dir_find(parent_ino, fname, name_len, &dirent) != EXIT_SUCCESS || readi(dirent.ino, &target) != EXIT_SUCCESS) {
+        return -ENOENT;
     }
-
-    inode_t new_inode = {
-        .ino = new_ino_num,
-        .valid = 1,
-        .size = 0,
-        .type = __S_IFDIR,
-        .link = 2,
-        .direct_ptr = {0},
-        .indirect_ptr = {0},
-        .vstat = {
-            .st_atime = time(NULL),
-            .st_ctime = time(NULL),
-            .st_mtime = time(NULL),
-            .st_gid = getegid(),
-            .st_uid = getuid(),
-            .st_ino = new_ino_num,
-            .st_mode = __S_IFDIR,
-            .st_nlink = 2,
-        }};
-
-    // Step 4: Call dir_add() to add directory entry of target directory to parent directory
-    // Step 5: Update inode for target directory
-    int result = dir_add(parent_dir_node, new_ino_num, path_name, strlen(path_name));
-
-    if (result == EXIT_SUCCESS) {
-        // Step 6: Call writei() to write inode to disk
-        if (writei(new_ino_num, &new_inode) == EXIT_SUCCESS) {
-            return EXIT_SUCCESS;
-        } else {
-            return EXIT_FAILURE;
+    if (dir) {
+        if (!S_ISDIR(target.type)) {
+            return -ENOTDIR;
         }
-    } else {
-        return EXIT_FAILURE;
+        if (target.ino == root_inode) {
+            return -EBUSY;
+        }
+        // every entry added to a directory adds to its link count, so more than 2 means it isn't empty
+        if (target.link > 2) {
+            return -ENOTEMPTY;
+        }
+    } else if (S_ISDIR(target.type)) {
+        return -EISDIR;
     }
 
+    // Step 2: Clear its inode bitmap and its data blocks (no cached path may lead through
+    // a removed directory any more)
+    if (release_inode(&target) != EXIT_SUCCESS) {
+        return -EIO;
+    }
+    if (dir) {
+        dir_gen_bump(target.ino);
+    }
+
+    // Step 3: Call dir_remove() to remove its directory entry from the parent directory
+    inode_t parent_dir_node;
+    if (readi(parent_ino, &parent_dir_node) != EXIT_SUCCESS) {
+        return -ENOENT;
+    }
+    if (dir_remove(parent_dir_node, fname, name_len) != EXIT_SUCCESS) {
+        return -EIO;
+    }
     return 0;
 }
 
 static int my_rmdir(const char *path) {
-
     // Step 1: Use dirname() and basename() to separate parent directory path and target directory name
-    char *dir_name = dirname(path);
-    char *base_name = basename(path);
-
-    inode_t parent_dir_node;
-    inode_t target_dir;
-
-    // Step 2: Call get_node_by_path() to get inode of target directory
-    if (get_node_by_path(base_name, root_inode, &target_dir) == EXIT_FAILURE) {
-        return -EXIT_FAILURE;
-    }
+    char dirname_copy[strlen(path) + 1];
+    char basename_copy[strlen(path) + 1];
 
-    // Step 3: Clear data block bitmap of target directory
-    for (int i = 0; i < NUM_DIRECT_PTRS; i++) {
-        int data_block = target_dir.direct_ptr[i];
-        if (data_block >= data_block_start) {
-            // if direct pointer points to a valid data block, clear its bit in the bitmap
-            // this allows that data block to be overwritten with fresh data
-            unset_bitmap(&d_bitmap, data_block);
-        }
-    }
+    strcpy(dirname_copy, path);
+    strcpy(basename_copy, path);
 
-    // Step 4: Clear inode bitmap and its data block
-    unset_bitmap(&i_bitmap, target_dir.ino);
+    char *dir_name = dirname(dirname_copy);
+    char *base_name = basename(basename_copy);
 
-    // Step 5: Call get_node_by_path() to get inode of parent directory
+    // Step 2: Call get_node_by_path() to get inode of parent directory
+    inode_t parent_dir_node;
     if (get_node_by_path(dir_name, root_inode, &parent_dir_node) == EXIT_FAILURE) {
-        return -EXIT_FAILURE;
+        return -ENOENT;
     }
 
-    // Step 6: Call dir_remove() to remove directory entry of target directory in its parent directory
-    dir_remove(&parent_dir_node, base_name, strlen(base_name));
-
-    return 0;
+    // Step 3: Remove the directory from it
+    return remove_node(parent_dir_node.ino, base_name, strlen(base_name), 1);
 }
 
 static int my_releasedir(const char *path, struct fuse_file_info *fi) {
@@ -1082,60 +3761,34 @@ static int my_releasedir(const char *path, struct fuse_file_info *fi) {
 }
 
 static int my_create(const char *path, mode_t mode, struct fuse_file_info *fi) {
-    char *dirname_copy[strlen(path)];
-    char *basename_copy[strlen(path)];
+    // Use dirname() and basename() to separate parent directory path and target file name
+    char dirname_copy[strlen(path) + 1];
+    char basename_copy[strlen(path) + 1];
 
     strcpy(dirname_copy, path);
     strcpy(basename_copy, path);
 
-    // Use dirname() and basename() to separate parent directory path and target file name
     char *dir_name = dirname(dirname_copy);
     char *path_name = basename(basename_copy);
 
     // Call get_node_by_path() to get inode of parent directory
     inode_t parent_dir_node;
-    int get_path_stat = get_node_by_path(dir_name, root_inode, &parent_dir_node);  // get inode of parent directory with directory name (dir_name)
-    if (get_path_stat == EXIT_FAILURE) {
-        return EXIT_FAILURE;
+    if (get_node_by_path(dir_name, root_inode, &parent_dir_node) == EXIT_FAILURE) {
+        return -ENOENT;
     }
-    // Call get_avail_ino() to get an available inode number
-    int new_ino_num = get_avail_ino();
-
-    inode_t new_inode = {
-        .ino = new_ino_num,
-        .valid = 1,
-        .size = 0,
-        .type = __S_IFREG,
-        .link = 1,
-        .direct_ptr = {0},
-        .indirect_ptr = {0},
-        .vstat = {
-            .st_atime = time(NULL),
-            .st_ctime = time(NULL),
-            .st_mtime = time(NULL),
-            .st_gid = getegid(),
-            .st_uid = getuid(),
-            .st_ino = new_ino_num,
-            .st_mode = __S_IFREG,
-            .st_nlink = 1,
-        }};
-
-    // Call dir_add() to add directory entry of target file to parent directory
-
-    int result = dir_add(parent_dir_node, new_ino_num, path_name, strlen(path_name));
-    if (result == EXIT_SUCCESS) {
-        // if the directory entry was added successfully, write to disk the new inode
-        if (writei(new_ino_num, &new_inode) == EXIT_SUCCESS) {
-            return EXIT_SUCCESS;
-        } else
-            return EXIT_FAILURE;
-    } else
-        return EXIT_FAILURE;
-
-    // Update inode for target file
 
-    // Call writei() to write inode to disk
+    // Make the file in it
+    inode_t new_inode;
+    const struct fuse_context *ctx = fuse_get_context();
+    int ret_stat = make_node(parent_dir_node, path_name, strlen(path_name), __S_IFREG | (mode & 07777), ctx->uid, ctx->gid, &new_inode);
+    if (ret_stat != 0) {
+        return ret_stat;
+    }
 
+    // (create opens the file too)
+    if (fi != NULL) {
+        fi->fh = (uintptr_t)open_file_new(new_inode.ino);
+    }
     return 0;
 }
 
@@ -1144,291 +3797,793 @@ static int my_open(const char *path, struct fuse_file_info *fi) {
     // Call get_node_by_path() to get inode from path
     inode_t target_ino;
 
-    if (get_node_by_path(path, root_inode, &target_ino) < 0) {  // Did not find ino
+    if (get_node_by_path(path, root_inode, &target_ino) != EXIT_SUCCESS) {  // Did not find ino
 
-        // If not find, return -1
-        return -1;
+        // If not find, return -ENOENT
+        return -ENOENT;
+    }
+
+    // while it is open, the file remembers where its last block lookup led (see bmap_cached())
+    if (fi != NULL && S_ISREG(target_ino.type)) {
+        fi->fh = (uintptr_t)open_file_new(target_ino.ino);
     }
 
     // if found return 0
     return 0;
 }
 
+/*
+ * Read size bytes at offset of a file into buffer. returns how many were read, or -errno
+ */
+static int file_read(inode_t target_ino, char *buffer, size_t size, off_t offset, struct fuse_file_info *fi) {
+    // Step 1: nothing to read at or past the end of the file, and never read past it
+    if (offset >= target_ino.size || size == 0) {
+        return 0;
+    }
+    if (offset + size > target_ino.size) {
+        size = target_ino.size - offset;
+    }
+
+    // a small file's contents are right there in its inode
+    if (target_ino.flags & INODE_INLINE_DATA) {
+        memcpy(buffer, target_ino.inline_data + offset, size);
+        return size;
+    }
+
+    // Step 2: Based on size and offset, read its data blocks from disk
+    // (all of them in one batch, rather than a round trip per block)
+    int first_block = (offset / BLOCK_SIZE);
+    int last_block = ((offset + size - 1) / BLOCK_SIZE);
+    bmap_prefetch(&target_ino, first_block, last_block);
+
+    // Step 3: copy the correct amount of data from each block to buffer
+    size_t bytes_read = 0;
+    for (int i = first_block; i <= last_block; i++) {
+        int offset_in_block = (offset + bytes_read) % BLOCK_SIZE;
+        size_t chunk = BLOCK_SIZE - offset_in_block;
+        if (chunk > size - bytes_read) {
+            chunk = size - bytes_read;
+        }
+
+        int blkno = bmap_cached(open_file_of(fi), &target_ino, i);
+        if (blkno < 0) {
+            return -EIO;
+        }
+        if (blkno >= data_block_start) {
+            const char *data_block = cache_get(blkno);
+            if (data_block == NULL) {
+                return -EIO;
+            }
+            memcpy(buffer + bytes_read, data_block + offset_in_block, chunk);
+            cache_put(blkno);
+        } else {
+            // a block not on disk yet is either pending (delayed allocation), or was never
+            // written and reads back as zeros
+            pthread_mutex_lock(&delalloc_lock);
+            const char *pending = delalloc_block(target_ino.ino, i, 0);
+            if (pending != NULL) {
+                memcpy(buffer + bytes_read, pending + offset_in_block, chunk);
+            } else {
+                memset(buffer + bytes_read, 0, chunk);
+            }
+            pthread_mutex_unlock(&delalloc_lock);
+        }
+
+        bytes_read += chunk;
+    }
+
+    // Upon success, return the number of bytes read
+    return bytes_read;
+}
+
 static int my_read(const char *path, char *buffer, size_t size, off_t offset, struct fuse_file_info *fi) {
     // Step 1: You could call get_node_by_path() to get inode from path
-
     inode_t target_ino;
+    if (get_node_by_path(path, root_inode, &target_ino) == EXIT_FAILURE) {
+        return -EXIT_FAILURE;
+    }
 
-    int get_path_result = get_node_by_path(path, root_inode, &target_ino);
+    // Step 2: Read from it
+    return file_read(target_ino, buffer, size, offset, fi);
+}
 
-    if (get_path_result == EXIT_FAILURE) {
-        return -EXIT_FAILURE;
+/*
+    size --> size of the data to write
+    offset --> where to write the data to in the file
+        if offset = 0, write the data at the start of the first block
+        if offset = 6000, write the data starting 1904 bytes into the second block
+*/
+static int file_write(inode_t target_ino, const char *buffer, size_t size, off_t offset, struct fuse_file_info *fi) {
+    // Step 1: Too much pending data: place the other files' pending blocks first
+    // (this file's stay pending, so they can still be placed next to the rest of it)
+    int blocks_touched = (size / BLOCK_SIZE) + 2;
+    if (__atomic_load_n(&delalloc_blocks, __ATOMIC_RELAXED) + blocks_touched > DELALLOC_MAX_BLOCKS) {
+        if (delalloc_flush_which(target_ino.ino, 1) != EXIT_SUCCESS) {
+            return -EIO;
+        }
+    }
+    if (__atomic_load_n(&delalloc_blocks, __ATOMIC_RELAXED) + blocks_touched > DELALLOC_MAX_BLOCKS) {
+        // this file alone has that much pending: its blocks are placed as well (they go
+        // right after the ones it already has, so a big file still ends up in long runs)
+        if (delalloc_flush(target_ino.ino) != EXIT_SUCCESS || readi(target_ino.ino, &target_ino) != EXIT_SUCCESS) {
+            return -EIO;
+        }
     }
 
-    // Step 2: Based on size and offset, read its data blocks from disk
-    if (size < 0) {
-        return -EXIT_FAILURE;
+    if (size == 0) {
+        return 0;
     }
 
-    for (int i = 0; i < NUM_DIRECT_PTRS; i++) {
+    // Step 1b: A small file's contents stay in its inode for as long as they fit there
+    if (target_ino.flags & INODE_INLINE_DATA) {
+        if (offset + size <= INLINE_DATA_SIZE) {
+            memcpy(target_ino.inline_data + offset, buffer, size);
+            if (offset + size > target_ino.size) {
+                target_ino.size = offset + size;
+            }
+            target_ino.mtime = target_ino.ctime = now_ns();
+            if (writei(target_ino.ino, &target_ino) == EXIT_FAILURE) {
+                return -EIO;
+            }
+            return size;
+        }
+        if (inline_promote(&target_ino) != EXIT_SUCCESS) {
+            return -ENOSPC;
+        }
     }
 
-    // NOTE: this variable will always be one (debug with print statements to see how it is executed)
-    int num_blocks_to_read = ceil(size / BLOCK_SIZE);
-    if (num_blocks_to_read == 0) {
-        num_blocks_to_read = 1;
+    int first_block = (offset / BLOCK_SIZE);
+    int last_block = ((offset + size - 1) / BLOCK_SIZE);
+    int max_blocks = bmap_max_blocks(&target_ino);
+    if (first_block >= max_blocks) {
+        return -EFBIG;
+    }
+    if (last_block >= max_blocks) {
+        // write as much as the file can map
+        last_block = max_blocks - 1;
+        size = ((off_t)max_blocks * BLOCK_SIZE) - offset;
     }
 
-    /*
-        if offset = 0, then read starting from first data block (data block 0)
-        if offset > 5000, then read starting from data block 1 (specifically, offset amount in data block 1) of target inode
-    */
-    int block_where_offset_is = (offset / BLOCK_SIZE);
+    // Step 2a: Fetch the existing blocks that are only partly overwritten in one batch,
+    // their old contents have to be kept around the new data
+    int partial[2] = {0, 0};
+    if (offset % BLOCK_SIZE != 0) {
+        partial[0] = bmap_cached(open_file_of(fi), &target_ino, first_block);
+    }
+    if ((offset + size) % BLOCK_SIZE != 0) {
+        partial[1] = bmap_cached(open_file_of(fi), &target_ino, last_block);
+    }
+    if (partial[0] < 0 || partial[1] < 0) {
+        return -EIO;
+    }
+    cache_prefetch(partial, 2);
+
+    // Step 2b: Copy the data into each block. Blocks the file doesn't have yet aren't
+    // allocated here: their data is kept pending, and they are placed on flush (see delalloc_place())
+    size_t bytes_written = 0;
+    for (int i = first_block; i <= last_block; i++) {
+        int offset_in_block = (offset + bytes_written) % BLOCK_SIZE;
+        size_t chunk = BLOCK_SIZE - offset_in_block;
+        if (chunk > size - bytes_written) {
+            chunk = size - bytes_written;
+        }
 
-    for (int i = 0; i < NUM_DIRECT_PTRS; i++) {
-        // if we're at the direct pointer that points to the data block where offset starts:
-        if (i == block_where_offset_is) {
-            // read this data block
+        int blkno = bmap_cached(open_file_of(fi), &target_ino, i);
+        if (blkno < 0) {
+            break;
+        }
+        if (blkno < data_block_start) {
+            pthread_mutex_lock(&delalloc_lock);
+            char *pending = delalloc_block(target_ino.ino, i, 1);
+            if (pending != NULL) {
+                memcpy(pending + offset_in_block, buffer + bytes_written, chunk);
+            }
+            pthread_mutex_unlock(&delalloc_lock);
 
-            if (target_ino.direct_ptr[i] >= data_block_start) {
-                memset(buff_mem, 0, BUFF_MEM_SIZE);
-                if (bio_read(target_ino.direct_ptr[i], buff_mem) < 0) {
-                    return -EXIT_FAILURE;
-                }
+            if (pending == NULL) {
+                break;  // no block left to reserve for it
+            }
+            bytes_written += chunk;
+            continue;
+        }
 
-                // now buff_mem holds the data block where offset is located
-                // copy size bytes from the offset of the data block to the buffer
+        memset(buff_mem, 0, BUFF_MEM_SIZE);
+        if (chunk != BLOCK_SIZE) {
+            // keep the part of the block this write doesn't cover
+            if (cache_read(blkno, buff_mem) < 0) {
+                break;
+            }
+        }
 
-                // Step 3: copy the correct amount of data from offset to buffer
-                offset %= BLOCK_SIZE;
-                memcpy(buffer, buff_mem + offset, ((size % BLOCK_SIZE == 0) ? BLOCK_SIZE : size % BLOCK_SIZE));
+        memcpy(buff_mem + offset_in_block, buffer + bytes_written, chunk);
+        if (cache_write(blkno, buff_mem) < 0) {
+            break;
+        }
 
-                /* NOTE: need to account for the scenario where you'll need to read more than 1 data block */
+        bytes_written += chunk;
+    }
+    memset(buff_mem, 0, BUFF_MEM_SIZE);
 
-                return size;
+    if (bytes_written == 0) {
+        return -ENOSPC;
+    }
 
-            } else {
-            }
-        }
+    // Step 3: update the inode's stats to reflect data changes, then write it to disk
+    // (on the cached inode itself: placing pending blocks may have changed its block
+    // mapping since target_ino was read, and that must not be undone here)
+    inode_t *inode = iget(target_ino.ino);
+    if (inode == NULL) {
+        return -EXIT_FAILURE;
+    }
+    if (offset + bytes_written > inode->size) {
+        inode->size = offset + bytes_written;
     }
+    inode->mtime = inode->ctime = now_ns();
 
-    // Upon success, return size
-    return -1;
+    int ret_stat = writei(inode->ino, inode);
+    iput(inode);
+    if (ret_stat == EXIT_FAILURE) {
+        return -EXIT_FAILURE;
+    }
+
+    // return the amount of data written
+    return bytes_written;
 }
 
-/*
-    size --> size of the data to write
-    offset --> where to write the data to in the block
-        if offset = 0, write the data at the start of the block
-        if offset = 2561, write the data starting at this offset
-*/
 static int my_write(const char *path, const char *buffer, size_t size, off_t offset, struct fuse_file_info *fi) {
-    for (int i = 0; i < size; i++) {
+    // Step 1: You could call get_node_by_path() to get inode from path
+    inode_t target_ino;
+    if (get_node_by_path(path, root_inode, &target_ino) == EXIT_FAILURE) {
+        return -EXIT_FAILURE;
     }
 
-    inode_t target_ino;
+    // Step 2: Write to it
+    return file_write(target_ino, buffer, size, offset, fi);
+}
 
-    // Step 1: You could call get_node_by_path() to get inode from path
+static int my_unlink(const char *path) {
+    // Step 1: Use dirname() and basename() to separate parent directory path and target file name
+    char dirname_copy[strlen(path) + 1];
+    char basename_copy[strlen(path) + 1];
 
-    int get_path_result = get_node_by_path(path, root_inode, &target_ino);
+    strcpy(dirname_copy, path);
+    strcpy(basename_copy, path);
 
-    if (get_path_result == EXIT_FAILURE) {
-        return -EXIT_FAILURE;
+    char *dir_name = dirname(dirname_copy);
+    char *base_name = basename(basename_copy);
+
+    // Step 2: Call get_node_by_path() to get inode of parent directory
+    inode_t parent_dir_node;
+    if (get_node_by_path(dir_name, root_inode, &parent_dir_node) == EXIT_FAILURE) {
+        return -ENOENT;
     }
 
-    // Step 2a: Based on size and offset, read its data blocks from disk
+    // Step 3: Remove the file from it
+    return remove_node(parent_dir_node.ino, base_name, strlen(base_name), 0);
+}
+
+/*
+ * Cut a file down, or grow it with zeros, to size bytes. returns 0, or -errno
+ */
+static int file_truncate(inode_t target_file, off_t size) {
+    // Step 1: Check the new size
+    if (S_ISDIR(target_file.type)) {
+        return -EISDIR;
+    }
     if (size < 0) {
-        return -1;
+        return -EINVAL;
+    }
+    if (size > (off_t)bmap_max_blocks(&target_file) * BLOCK_SIZE) {
+        return -EFBIG;
     }
 
-    for (int i = 0; i < NUM_DIRECT_PTRS; i++) {
+    // Step 1b: A small file kept in its inode only moves out of it if it grows too big for it
+    if (target_file.flags & INODE_INLINE_DATA) {
+        if (size <= INLINE_DATA_SIZE) {
+            if (size < target_file.size) {
+                memset(target_file.inline_data + size, 0, INLINE_DATA_SIZE - size);
+            }
+            target_file.size = size;
+            target_file.mtime = target_file.ctime = now_ns();
+            if (writei(target_file.ino, &target_file) == EXIT_FAILURE) {
+                return -EIO;
+            }
+            return 0;
+        }
+        if (inline_promote(&target_file) != EXIT_SUCCESS) {
+            return -ENOSPC;
+        }
     }
 
-    // NOTE: size will always be >= 0 and <= 4096 (or 1 block), so num_blocks_copy would always be 1
-    int num_blocks_copy = ceil(size / BLOCK_SIZE);
-    if (num_blocks_copy == 0) {
-        num_blocks_copy = 1;
+    // Step 2: Free the data blocks that are entirely past the new end of the file
+    int blocks_kept = (size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    if (bmap_truncate(&target_file, blocks_kept) != EXIT_SUCCESS) {
+        return -EIO;
     }
 
-    int block_where_offset_is = (offset / BLOCK_SIZE);
+    delalloc_truncate(target_file.ino, size);
+
+    // Step 3: Zero the cut off part of the last block, so growing the file again reads zeros there
+    int last = (size % BLOCK_SIZE != 0) ? bmap(&target_file, blocks_kept - 1, NULL) : 0;
+    if (size < target_file.size && last >= data_block_start) {
+        memset(buff_mem, 0, BUFF_MEM_SIZE);
+        if (cache_read(last, buff_mem) < 0) {
+            return -EIO;
+        }
+        memset(buff_mem + (size % BLOCK_SIZE), 0, BLOCK_SIZE - (size % BLOCK_SIZE));
+        if (cache_write(last, buff_mem) < 0) {
+            return -EIO;
+        }
+        memset(buff_mem, 0, BUFF_MEM_SIZE);
+    }
 
-    for (int i = 0; i < NUM_DIRECT_PTRS; i++) {
-        // read block where offset is, since this is where you must start writing
-        if (i == block_where_offset_is) {
-            // once you get to this location, start reading and writing
+    // Step 4: Update the inode and write it to disk
+    target_file.size = size;
+    target_file.mtime = target_file.ctime = now_ns();
+    if (writei(target_file.ino, &target_file) == EXIT_FAILURE) {
+        return -EIO;
+    }
 
-            if (target_ino.direct_ptr[i] >= data_block_start) {
-                // if this data block is valid, proceed with reading and writing
+    return 0;
+}
 
-                // if it IS valid, read this block to buff_mem
-                memset(buff_mem, 0, BUFF_MEM_SIZE);
-                if (bio_read(target_ino.direct_ptr[i], buff_mem) < 0) {
-                    return -EXIT_FAILURE;
-                }
+static int my_truncate(const char *path, off_t size) {
+    // Step 1: Call get_node_by_path() to get inode of target file
+    inode_t target_file;
+    if (get_node_by_path(path, root_inode, &target_file) == EXIT_FAILURE) {
+        return -ENOENT;
+    }
 
-                offset %= BLOCK_SIZE;
-                // copy the data from the buffer to this data block and position of the offset it belongs
-                memcpy(buff_mem + offset, buffer, ((size % BLOCK_SIZE == 0) ? BLOCK_SIZE : size % BLOCK_SIZE));
+    // Step 2: Truncate it
+    return file_truncate(target_file, size);
+}
 
-                // write this data block back to disk
-                if (bio_write(target_ino.direct_ptr[i], buff_mem) < 0) {
-                    return -EXIT_FAILURE;
-                }
+/*
+ * Place a file's pending data (ino -1: none), then write back whatever it (and everyone
+ * else) left dirty in the block cache. returns 0, or -errno
+ */
+static int file_sync(int ino) {
+    if (ino != -1 && delalloc_flush(ino) != EXIT_SUCCESS) {
+        return -EIO;
+    }
 
-                // update target_ino stats to reflect data changes
-                target_ino.size += size;
-                target_ino.vstat.st_atime = time(NULL);
-                target_ino.vstat.st_mtime = time(NULL);
-                target_ino.vstat.st_size += size;
+    punch_freed_blocks();
+    if (sync_bitmaps() != EXIT_SUCCESS || icache_flush() != EXIT_SUCCESS || cache_flush() < 0) {
+        return -EIO;
+    }
+    return 0;
+}
 
-                // update the target inode on disk:
-                int target_inode_block_num = inode_table_index + (target_ino.ino / inodes_in_block);
-                int offset_in_block = (target_ino.ino % inodes_in_block);
+static int my_release(const char *path, struct fuse_file_info *fi) {
+    if (open_file_of(fi) != NULL) {
+        open_file_free(open_file_of(fi));
+        fi->fh = 0;
+    }
 
-                // read the inode block where the target_ino.ino number exists:
-                memset(buff_mem, 0, BUFF_MEM_SIZE);
-                if (bio_read(target_inode_block_num, buff_mem) < 0) {
-                    return -EXIT_FAILURE;
-                }
+    inode_t target_ino;
+    return file_sync((get_node_by_path(path, root_inode, &target_ino) == EXIT_SUCCESS) ? (int)target_ino.ino : -1);
+}
 
-                // copy the updated inode (with the updated stats) to the inode block at it's proper offset
-                memcpy(buff_mem + (offset_in_block * sizeof(inode_t)), &target_ino, sizeof(inode_t));
+static int my_flush(const char *path, struct fuse_file_info *fi) {
+    inode_t target_ino;
+    return file_sync((get_node_by_path(path, root_inode, &target_ino) == EXIT_SUCCESS) ? (int)target_ino.ino : -1);
+}
 
-                // write this inode block back to disk
-                if (bio_write(target_inode_block_num, buff_mem) < 0) {
-                    return -EXIT_FAILURE;
-                }
+static int my_utimens(const char *path, const struct timespec tv[2]) {
+    
+    return 0;
+}
 
-                // write updated target inode back to disk
-                if (writei(target_ino.ino, &target_ino) == EXIT_FAILURE) {
-                    return -EXIT_FAILURE;
-                }
+static struct fuse_operations rufs_ope = {
+    .init = my_init,
+    .destroy = my_destroy,
 
-                // return size indicating how much data was written and that operation was successful
-                return size;
+    .getattr = my_getattr,
+    .readdir = my_readdir,
+    .opendir = my_opendir,
+    .releasedir = my_releasedir,
+    .mkdir = my_mkdir,
+    .rmdir = my_rmdir,
 
-            } else {
-                // if this data block is invalid need to allocate the data block
+    .create = my_create,
+    .open = my_open,
+    .read = my_read,
+    .write = my_write,
+    .unlink = my_unlink,
 
-                // the next data block we want to write to is invalid, so create a new one:
+    .truncate = my_truncate,
+    .flush = my_flush,
+    .utimens = my_utimens,
+    .release = my_release
+};
+
+/*
+ * Low-level frontend (-o lowlevel): the same file system served through fuse_lowlevel_ops.
+ * The kernel names files by node id there instead of by path, so no request walks a path:
+ * a node id is the file's inode number plus one (the root, inode 0, has to be FUSE_ROOT_ID),
+ * and a name is only ever looked up in the one directory it is in. Nothing is kept per node
+ * id, so forget has nothing to drop.
+ */
+#define LL_INO(nodeid) ((int)(nodeid) - 1)
+#define LL_NODEID(ino) ((fuse_ino_t)(ino) + 1)
+#define LL_TIMEOUT 1.0  // seconds the kernel may keep the names and attributes it is given
+
+// a struct stat of an inode as the kernel sees it (numbered by node id)
+static void ll_stat(const inode_t *inode, struct stat *stbuf) {
+    inode_stat(inode, stbuf);
+    stbuf->st_ino = LL_NODEID(inode->ino);
+}
 
-                target_ino.direct_ptr[i] = get_avail_blkno();
+/*
+ * readi() for a node id: the kernel may still hold the node id of a file that has since
+ * been removed (an open file, say), whose inode is no longer valid
+ */
+static int ll_readi(fuse_ino_t nodeid, inode_t *inode) {
+    if (readi(LL_INO(nodeid), inode) != EXIT_SUCCESS || !inode->valid) {
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
 
-                memset(buff_mem, 0, BUFF_MEM_SIZE);
-                if (bio_read(target_ino.direct_ptr[i], buff_mem) < 0) {
-                    return -EXIT_FAILURE;
-                }
+static void ll_entry(const inode_t *inode, struct fuse_entry_param *e) {
+    memset(e, 0, sizeof(struct fuse_entry_param));
+    e->ino = LL_NODEID(inode->ino);
+    e->attr_timeout = LL_TIMEOUT;
+    e->entry_timeout = LL_TIMEOUT;
+    ll_stat(inode, &e->attr);
+}
 
-                offset %= BLOCK_SIZE;
-                memcpy(buff_mem + offset, buffer, ((size % BLOCK_SIZE == 0) ? BLOCK_SIZE : size % BLOCK_SIZE));
+static void my_ll_init(void *userdata, struct fuse_conn_info *conn) {
+    my_init(conn);
+}
 
-                if (bio_write(target_ino.direct_ptr[i], buff_mem) < 0) {
-                    return -EXIT_FAILURE;
-                }
+static void my_ll_destroy(void *userdata) {
+    my_destroy(userdata);
+}
 
-                // update target_ino stats to reflect data changes
-                target_ino.size += size;
-                target_ino.vstat.st_atime = time(NULL);
-                target_ino.vstat.st_mtime = time(NULL);
-                target_ino.vstat.st_size += size;
+static void my_ll_lookup(fuse_req_t req, fuse_ino_t parent, const char *name) {
+    // a name that isn't there is answered with node id 0, so the kernel remembers that too
+    struct fuse_entry_param e;
+    dirent_t dirent;
+    inode_t inode;
+    int ret_stat = dir_find(LL_INO(parent), name, strlen(name), &dirent);
+    if (ret_stat == -ENOENT) {
+        memset(&e, 0, sizeof(struct fuse_entry_param));
+        e.entry_timeout = LL_TIMEOUT;
+        fuse_reply_entry(req, &e);
+        return;
+    }
+    if (ret_stat != 0) {
+        fuse_reply_err(req, -ret_stat);
+        return;
+    }
+    if (readi(dirent.ino, &inode) != EXIT_SUCCESS) {
+        fuse_reply_err(req, EIO);
+        return;
+    }
 
-                // update the target inode on disk:
-                int target_inode_block_num = inode_table_index + (target_ino.ino / inodes_in_block);
-                int offset_in_block = (target_ino.ino % inodes_in_block);
+    ll_entry(&inode, &e);
+    fuse_reply_entry(req, &e);
+}
 
-                // read the inode block where the target_ino.ino number exists:
-                memset(buff_mem, 0, BUFF_MEM_SIZE);
-                if (bio_read(target_inode_block_num, buff_mem) < 0) {
-                    return -EXIT_FAILURE;
-                }
+static void my_ll_forget(fuse_req_t req, fuse_ino_t ino, unsigned long nlookup) {
+    fuse_reply_none(req);
+}
 
-                memcpy(buff_mem + (offset_in_block * sizeof(inode_t)), &target_ino, sizeof(inode_t));
+static void my_ll_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+    inode_t inode;
+    if (ll_readi(ino, &inode) != EXIT_SUCCESS) {
+        fuse_reply_err(req, ENOENT);
+        return;
+    }
 
-                // write this inode block back to disk
-                if (bio_write(target_inode_block_num, buff_mem) < 0) {
-                    return -EXIT_FAILURE;
-                }
+    struct stat st;
+    ll_stat(&inode, &st);
+    fuse_reply_attr(req, &st, LL_TIMEOUT);
+}
 
-                if (writei(target_ino.ino, &target_ino) == EXIT_FAILURE) {
-                    return -EXIT_FAILURE;
-                }
+static void my_ll_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr, int to_set, struct fuse_file_info *fi) {
+    inode_t inode;
+    if (ll_readi(ino, &inode) != EXIT_SUCCESS) {
+        fuse_reply_err(req, ENOENT);
+        return;
+    }
 
-                return size;
-            }
+    // Step 1: Nothing is changed if any of it can't be
+    int supported = FUSE_SET_ATTR_SIZE | FUSE_SET_ATTR_MODE | FUSE_SET_ATTR_UID | FUSE_SET_ATTR_GID |
+                    FUSE_SET_ATTR_ATIME | FUSE_SET_ATTR_MTIME;
+#ifdef FUSE_SET_ATTR_ATIME_NOW
+    supported |= FUSE_SET_ATTR_ATIME_NOW | FUSE_SET_ATTR_MTIME_NOW;
+#endif
+    if (to_set & ~supported) {
+        fuse_reply_err(req, ENOSYS);
+        return;
+    }
+
+    // Step 2: The size first, it is the one that can fail (truncating writes the inode back itself)
+    if (to_set & FUSE_SET_ATTR_SIZE) {
+        int ret_stat = file_truncate(inode, attr->st_size);
+        if (ret_stat != 0 || readi(inode.ino, &inode) != EXIT_SUCCESS) {
+            fuse_reply_err(req, (ret_stat != 0) ? -ret_stat : EIO);
+            return;
         }
     }
 
-    // Upon reaching this point, return -1 to indicate something went wrong as this functin should have returned earlier
+    // Step 3: Then the permission bits, the owner and the times
+    if (to_set & ~FUSE_SET_ATTR_SIZE) {
+        int64_t now = now_ns();
+        if (to_set & FUSE_SET_ATTR_MODE) {
+            inode.type = (inode.type & S_IFMT) | (attr->st_mode & 07777);
+        }
+        if (to_set & FUSE_SET_ATTR_UID) {
+            inode.uid = attr->st_uid;
+        }
+        if (to_set & FUSE_SET_ATTR_GID) {
+            inode.gid = attr->st_gid;
+        }
+        if (to_set & FUSE_SET_ATTR_ATIME) {
+            inode.atime = timespec_to_ns(&attr->st_atim);
+        }
+        if (to_set & FUSE_SET_ATTR_MTIME) {
+            inode.mtime = timespec_to_ns(&attr->st_mtim);
+        }
+#ifdef FUSE_SET_ATTR_ATIME_NOW
+        if (to_set & FUSE_SET_ATTR_ATIME_NOW) {
+            inode.atime = now;
+        }
+        if (to_set & FUSE_SET_ATTR_MTIME_NOW) {
+            inode.mtime = now;
+        }
+#endif
+        inode.ctime = now;
+        if (writei(inode.ino, &inode) != EXIT_SUCCESS) {
+            fuse_reply_err(req, EIO);
+            return;
+        }
+    }
 
-    return -1;
+    struct stat st;
+    ll_stat(&inode, &st);
+    fuse_reply_attr(req, &st, LL_TIMEOUT);
 }
 
-static int my_unlink(const char *path) {
-    // Step 1: Use dirname() and basename() to separate parent directory path and target file name
+// a readdir reply being filled in
+typedef struct ll_dirbuf {
+    fuse_req_t req;
+    char *buf;
+    size_t size;
+    size_t used;
+} ll_dirbuf_t;
+
+// fuse_fill_dir_t for dir_list(): add an entry to a readdir reply (1 once it has no room left)
+static int ll_fill_dir(void *buffer, const char *name, const struct stat *stbuf, off_t off) {
+    ll_dirbuf_t *db = buffer;
+    struct stat st = *stbuf;
+    st.st_ino = LL_NODEID(stbuf->st_ino);
+
+    size_t len = fuse_add_direntry(db->req, db->buf + db->used, db->size - db->used, name, &st, off);
+    if (len > db->size - db->used) {
+        return 1;
+    }
+    db->used += len;
+    return 0;
+}
 
-    // Step 2: Call get_node_by_path() to get inode of target file
+static void my_ll_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, struct fuse_file_info *fi) {
+    inode_t dir_inode;
+    if (ll_readi(ino, &dir_inode) != EXIT_SUCCESS) {
+        fuse_reply_err(req, ENOENT);
+        return;
+    }
+    if (!S_ISDIR(dir_inode.type)) {
+        fuse_reply_err(req, ENOTDIR);
+        return;
+    }
 
-    // Step 3: Clear data block bitmap of target file
+    ll_dirbuf_t db = {.req = req, .buf = malloc(size), .size = size, .used = 0};
+    if (db.buf == NULL) {
+        fuse_reply_err(req, ENOMEM);
+        return;
+    }
+    int ret_stat = dir_list(dir_inode, off, &db, ll_fill_dir);
+    if (ret_stat != 0) {
+        fuse_reply_err(req, -ret_stat);
+    } else {
+        fuse_reply_buf(req, db.buf, db.used);
+    }
+    free(db.buf);
+}
 
-    // Step 4: Clear inode bitmap and its data block
+static void my_ll_mkdir(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode) {
+    inode_t parent_dir_node;
+    inode_t new_inode;
+    if (ll_readi(parent, &parent_dir_node) != EXIT_SUCCESS) {
+        fuse_reply_err(req, ENOENT);
+        return;
+    }
+    const struct fuse_ctx *ctx = fuse_req_ctx(req);
+    int ret_stat = make_node(parent_dir_node, name, strlen(name), __S_IFDIR | (mode & 07777), ctx->uid, ctx->gid, &new_inode);
+    if (ret_stat != 0) {
+        fuse_reply_err(req, -ret_stat);
+        return;
+    }
 
-    // Step 5: Call get_node_by_path() to get inode of parent directory
+    struct fuse_entry_param e;
+    ll_entry(&new_inode, &e);
+    fuse_reply_entry(req, &e);
+}
 
-    // Step 6: Call dir_remove() to remove directory entry of target file in its parent directory
+static void my_ll_create(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode, struct fuse_file_info *fi) {
+    inode_t parent_dir_node;
+    inode_t new_inode;
+    if (ll_readi(parent, &parent_dir_node) != EXIT_SUCCESS) {
+        fuse_reply_err(req, ENOENT);
+        return;
+    }
+    const struct fuse_ctx *ctx = fuse_req_ctx(req);
+    int ret_stat = make_node(parent_dir_node, name, strlen(name), __S_IFREG | (mode & 07777), ctx->uid, ctx->gid, &new_inode);
+    if (ret_stat != 0) {
+        fuse_reply_err(req, -ret_stat);
+        return;
+    }
 
-    return 0;
+    // (create opens the file too)
+    fi->fh = (uintptr_t)open_file_new(new_inode.ino);
+    struct fuse_entry_param e;
+    ll_entry(&new_inode, &e);
+    fuse_reply_create(req, &e, fi);
 }
 
-static int my_truncate(const char *path, off_t size) {
-    
-    return 0;
+static void my_ll_unlink(fuse_req_t req, fuse_ino_t parent, const char *name) {
+    fuse_reply_err(req, -remove_node(LL_INO(parent), name, strlen(name), 0));
 }
 
-static int my_release(const char *path, struct fuse_file_info *fi) {
-    
-    return 0;
+static void my_ll_rmdir(fuse_req_t req, fuse_ino_t parent, const char *name) {
+    fuse_reply_err(req, -remove_node(LL_INO(parent), name, strlen(name), 1));
 }
 
-static int my_flush(const char *path, struct fuse_file_info *fi) {
-    
-    return 0;
+static void my_ll_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+    inode_t inode;
+    if (ll_readi(ino, &inode) != EXIT_SUCCESS) {
+        fuse_reply_err(req, ENOENT);
+        return;
+    }
+
+    // while it is open, the file remembers where its last block lookup led (see bmap_cached())
+    if (S_ISREG(inode.type)) {
+        fi->fh = (uintptr_t)open_file_new(inode.ino);
+    }
+    fuse_reply_open(req, fi);
 }
 
-static int my_utimens(const char *path, const struct timespec tv[2]) {
-    
-    return 0;
+static void my_ll_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, struct fuse_file_info *fi) {
+    inode_t inode;
+    if (ll_readi(ino, &inode) != EXIT_SUCCESS) {
+        fuse_reply_err(req, ENOENT);
+        return;
+    }
+
+    char *buffer = malloc(size);
+    if (buffer == NULL) {
+        fuse_reply_err(req, ENOMEM);
+        return;
+    }
+    int bytes_read = file_read(inode, buffer, size, off, fi);
+    if (bytes_read < 0) {
+        fuse_reply_err(req, -bytes_read);
+    } else {
+        fuse_reply_buf(req, buffer, bytes_read);
+    }
+    free(buffer);
 }
 
-static struct fuse_operations rufs_ope = {
-    .init = my_init,
-    .destroy = my_destroy,
+static void my_ll_write(fuse_req_t req, fuse_ino_t ino, const char *buf, size_t size, off_t off, struct fuse_file_info *fi) {
+    inode_t inode;
+    if (ll_readi(ino, &inode) != EXIT_SUCCESS) {
+        fuse_reply_err(req, ENOENT);
+        return;
+    }
 
-    .getattr = my_getattr,
-    .readdir = my_readdir,
-    .opendir = my_opendir,
-    .releasedir = my_releasedir,
-    .mkdir = my_mkdir,
-    .rmdir = my_rmdir,
+    int bytes_written = file_write(inode, buf, size, off, fi);
+    if (bytes_written < 0) {
+        fuse_reply_err(req, -bytes_written);
+    } else {
+        fuse_reply_write(req, bytes_written);
+    }
+}
 
-    .create = my_create,
-    .open = my_open,
-    .read = my_read,
-    .write = my_write,
-    .unlink = my_unlink,
+static void my_ll_flush(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+    fuse_reply_err(req, -file_sync(LL_INO(ino)));
+}
 
-    .truncate = my_truncate,
-    .flush = my_flush,
-    .utimens = my_utimens,
-    .release = my_release
+static void my_ll_release(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi) {
+    if (open_file_of(fi) != NULL) {
+        open_file_free(open_file_of(fi));
+        fi->fh = 0;
+    }
+    fuse_reply_err(req, -file_sync(LL_INO(ino)));
+}
+
+static struct fuse_lowlevel_ops rufs_ll_ope = {
+    .init = my_ll_init,
+    .destroy = my_ll_destroy,
+
+    .lookup = my_ll_lookup,
+    .forget = my_ll_forget,
+    .getattr = my_ll_getattr,
+    .setattr = my_ll_setattr,
+    .readdir = my_ll_readdir,
+    .mkdir = my_ll_mkdir,
+    .rmdir = my_ll_rmdir,
+
+    .create = my_ll_create,
+    .open = my_ll_open,
+    .read = my_ll_read,
+    .write = my_ll_write,
+    .unlink = my_ll_unlink,
+
+    .flush = my_ll_flush,
+    .release = my_ll_release
 };
 
+/*
+ * fuse_main() for the low-level frontend: mount, then serve requests until unmounted
+ * (single threaded)
+ */
+static int ll_main(struct fuse_args *args) {
+    char *mountpoint = NULL;
+    int multithreaded;
+    int foreground;
+    int err = -1;
+
+    if (fuse_parse_cmdline(args, &mountpoint, &multithreaded, &foreground) == -1) {
+        return EXIT_FAILURE;
+    }
+
+    struct fuse_chan *ch = fuse_mount(mountpoint, args);
+    if (ch != NULL) {
+        struct fuse_session *se = fuse_lowlevel_new(args, &rufs_ll_ope, sizeof(rufs_ll_ope), NULL);
+        if (se != NULL) {
+            if (fuse_set_signal_handlers(se) != -1) {
+                fuse_session_add_chan(se, ch);
+                fuse_daemonize(foreground);
+                // one request at a time, whatever -s says: the directory and file helpers
+                // share buff_mem, and nothing keeps two changes to one directory apart
+                err = fuse_session_loop(se);
+                fuse_remove_signal_handlers(se);
+                fuse_session_remove_chan(ch);
+            }
+            fuse_session_destroy(se);
+        }
+        fuse_unmount(mountpoint, ch);
+    }
+    free(mountpoint);
+
+    return err ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
 int main(int argc, char *argv[]) {
     int fuse_stat;
 
+    struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+
     getcwd(diskfile_path, PATH_MAX);
     strcat(diskfile_path, "/DISKFILE");
 
-    fuse_stat = fuse_main(argc, argv, &rufs_ope, NULL);
+    // pull out the rufs specific mount options, pass the rest on to FUSE
+    if (fuse_opt_parse(&args, &config, rufs_opts, NULL) == -1) {
+        return EXIT_FAILURE;
+    }
+
+    // requests are served one at a time (see ll_main()), by the path frontend too
+    if (config.use_lowlevel) {
+        fuse_stat = ll_main(&args);
+    } else if (fuse_opt_add_arg(&args, "-s") == -1) {
+        fuse_stat = EXIT_FAILURE;
+    } else {
+        fuse_stat = fuse_main(args.argc, args.argv, &rufs_ope, NULL);
+    }
 
+    fuse_opt_free_args(&args);
     return fuse_stat;
 }
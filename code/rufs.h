@@ -14,42 +14,172 @@
 #define _TFS_H
 
 #define MAGIC_NUM 0x5C3A
-#define MAX_INUM 1024
-#define MAX_DNUM 16384
+#define RUFS_VERSION 5			// on-disk format version (5: directory index kept as a B+tree)
+#define MAX_INUM 131072			// INODES_PER_GROUP in each of up to MAX_GROUPS block groups
+#define MAX_DNUM 32768			// DATA_BLOCKS_PER_GROUP in each of up to MAX_GROUPS block groups
+
+/*
+ * The disk is laid out in block groups after the superblock: each group has its own
+ * inode bitmap and data block bitmap, followed by its data blocks (the last group may
+ * have fewer data blocks, if that is all the disk has room for). A group's inode table
+ * is not set aside up front: it is made of chunks of INODES_PER_CHUNK inodes, each one
+ * a run of data blocks of the group allocated when its first inode is, and found
+ * through the superblock's inode_chunks map.
+ */
+#define INODES_PER_GROUP 8192		// (a bitmap block has room for 4 times as many)
+#define INODES_PER_CHUNK 256		// 8 blocks of inodes
+#define CHUNKS_PER_GROUP (INODES_PER_GROUP / INODES_PER_CHUNK)
+#define DATA_BLOCKS_PER_GROUP 2048	// a multiple of 64, so no two groups share a bitmap word in memory
+#define MAX_GROUPS (MAX_DNUM / DATA_BLOCKS_PER_GROUP)
 
 #define BUFF_MEM_SIZE 4096		// 8MB of buffer size (subject to change)
 #define I_BITMAP_SIZE (MAX_INUM / 8) 	// size of inode bitmap
 #define D_BITMAP_SIZE (MAX_DNUM / 8) 	// size of dnoe bitmap
 #define NUM_DIRECT_PTRS 16
+#define NUM_INDIRECT_PTRS 2		// a single and a double indirect pointer
+
+/*
+ * superblock features
+ */
+#define FEATURE_BLOCKMAP 0x1	// new files map their blocks with direct and indirect pointers rather than extents
+
+/*
+ * inode flags
+ */
+#define INODE_INLINE_DATA 0x1	// the file's contents are kept in the inode, where its block pointers would be
+#define INODE_EXTENTS 0x2		// the file's blocks are mapped by an extent tree rooted in the inode
+#define INODE_INDEXED 0x4		// a directory whose entries are found through a hashed index (see dx_entry_t)
+#define INLINE_DATA_SIZE (sizeof(int) * (NUM_DIRECT_PTRS + NUM_INDIRECT_PTRS))
 
 typedef struct superblock {
 	uint32_t	magic_num;			/* magic number */
-	uint16_t	max_inum;			/* maximum inode number */
-	uint16_t	max_dnum;			/* maximum data block number */
-	uint32_t	i_bitmap_blk;		/* start block of inode bitmap */
-	uint32_t	d_bitmap_blk;		/* start block of data block bitmap */
-	uint32_t	i_start_blk;		/* start block of inode region */
-	uint32_t	d_start_blk;		/* start block of data block region */
+	uint32_t	version;			/* on-disk format version */
+	uint32_t	max_inum;			/* maximum inode number */
+	uint32_t	max_dnum;			/* maximum data block number */
+	uint32_t	i_bitmap_blk;		/* start block of inode bitmap (of group 0) */
+	uint32_t	d_bitmap_blk;		/* start block of data block bitmap (of group 0) */
+	uint32_t	i_start_blk;		/* unused: the inode tables are in inode_chunks */
+	uint32_t	d_start_blk;		/* start block of data block region (of group 0) */
+	uint32_t	groups;				/* number of block groups */
+	uint32_t	blocks_per_group;	/* distance between the same block of two groups */
+	uint32_t	inodes_per_group;	/* inodes in each group */
+	uint32_t	data_per_group;		/* data blocks in each group (but maybe the last) */
+	uint32_t	features;			/* FEATURE_* chosen when the disk was made */
+	uint32_t	inode_chunks[MAX_GROUPS][CHUNKS_PER_GROUP];	/* first block of each chunk of each group's inode table (0: none yet) */
 } superblock_t;
 
+/*
+ * Extent tree: each node is a header followed by its records, the root in the inode
+ * (where the block pointers would be) and every other node in a block of its own.
+ * At depth 0 a record maps len blocks of the file from logical block lblk on onto
+ * the consecutive blocks from pblk on; above that, it points to the node (at block pblk)
+ * holding the records from lblk on. The records of a node are ordered by lblk.
+ */
+#define EXTENT_MAGIC 0xF30A
+
+typedef struct extent_header {
+	uint16_t	magic;				/* EXTENT_MAGIC */
+	uint16_t	entries;			/* records in use */
+	uint16_t	max;				/* records the node has room for */
+	uint16_t	depth;				/* 0: the records map blocks, else they point to nodes */
+} extent_header_t;
+
+typedef struct extent_rec {
+	uint32_t	lblk;				/* first logical block */
+	uint32_t	pblk;				/* first physical block, or the block of the node below */
+	uint32_t	len;				/* number of blocks (depth 0 only) */
+} extent_rec_t;
+
+#define EXTENTS_IN_INODE ((INLINE_DATA_SIZE - sizeof(extent_header_t)) / sizeof(extent_rec_t))
+
+/*
+ * On-disk inode: only what rufs itself needs, 128 bytes so 32 fit in a block
+ * (it is turned into a struct stat at the FUSE boundary, in my_getattr)
+ */
 typedef struct inode {
-	uint16_t	ino;				/* inode number */
+	uint32_t	ino;				/* inode number */
 	uint16_t	valid;				/* validity of the inode */
-	uint32_t	size;				/* size of the file */
-	uint32_t	type;				/* type of the file */
+	uint16_t	version;			/* inode format version (RUFS_VERSION) */
+	uint16_t	flags;				/* per inode flags */
+	uint16_t	pad;
+	uint32_t	type;				/* mode: type of the file and its permissions */
 	uint32_t	link;				/* link count */
-	int			direct_ptr[NUM_DIRECT_PTRS];		/* direct pointer to data block */
-	int			indirect_ptr[8];	/* indirect pointer to data block */
-	struct stat	vstat;				/* inode stat */
+	uint32_t	uid;				/* user ID of owner */
+	uint32_t	gid;				/* group ID of owner */
+	uint32_t	size;				/* size of the file */
+	int64_t		atime;				/* last access time (ns since the epoch) */
+	int64_t		mtime;				/* last modification time (ns since the epoch) */
+	int64_t		ctime;				/* last status change time (ns since the epoch) */
+	union {
+		struct {
+			int		direct_ptr[NUM_DIRECT_PTRS];		/* direct pointer to data block */
+			int		indirect_ptr[NUM_INDIRECT_PTRS];	/* single, then double indirect pointer block */
+		};
+		struct {
+			extent_header_t	ext_header;					/* extent tree root (INODE_EXTENTS) */
+			extent_rec_t	ext_root[EXTENTS_IN_INODE];
+		};
+		char		inline_data[INLINE_DATA_SIZE];		/* contents of a small file (INODE_INLINE_DATA) */
+	};
 } inode_t;
 
+/*
+ * Directory blocks are packed with variable-length records: a dir_rec_t followed by the
+ * name (without a NUL), rec_len bytes in all, which is the name's DIR_REC_SIZE plus
+ * whatever free space follows the record. The records of a block cover all of it but the
+ * dir_tail_t at its end, a record with name_len 0 is unused (it can only be the first one,
+ * the space of any other record that is removed goes to the record before it).
+ */
+#define DIR_NAME_MAX 255
+#define DIR_REC_SIZE(name_len) ((sizeof(dir_rec_t) + (name_len) + 3) & ~3)
+#define DIR_BLOCK_SPACE (BLOCK_SIZE - sizeof(dir_tail_t))
+
+typedef struct dir_rec {
+	uint32_t	ino;				/* inode number of the directory entry */
+	uint16_t	rec_len;			/* bytes from this record to the next one */
+	uint8_t		name_len;			/* length of name (0: unused) */
+	uint8_t		pad;
+} dir_rec_t;
+
+typedef struct dir_tail {
+	uint32_t	next;				/* block of the directory holding the next leaf in hash order (0: none) */
+	uint32_t	pad;
+} dir_tail_t;
+
+/*
+ * a directory entry as dir_find() returns it
+ */
 typedef struct dirent {
-	uint16_t ino;					/* inode number of the directory entry */
+	uint32_t ino;					/* inode number of the directory entry */
 	uint16_t valid;					/* validity of the directory entry */
-	char name[208];					/* name of the directory entry */
 	uint16_t len;					/* length of name */
+	char name[DIR_NAME_MAX + 1];	/* name of the directory entry */
 } dirent_t;
 
+/*
+ * Directory index: block 0 of an INODE_INDEXED directory is the root of a B+tree keyed by
+ * name hash, and its other blocks are index blocks or leaves of dirents. An index block is a
+ * header followed by count entries ordered by hash, entry i leading to the block (by its
+ * block number within the directory) for every name whose hash is at least its hash and
+ * below the next entry's; the first entry's hash is 0. The root's levels says how many
+ * levels of index blocks are between it and the leaves. Names with the same hash are always
+ * in the same leaf, and the leaves are chained in hash order through their dir_tail_t.
+ */
+#define DX_MAGIC 0xD1D3
+
+typedef struct dx_header {
+	uint16_t	magic;				/* DX_MAGIC */
+	uint16_t	count;				/* entries in use */
+	uint16_t	limit;				/* entries the block has room for */
+	uint16_t	levels;				/* levels of index below this one */
+	uint32_t	blocks;				/* blocks of the directory (root only) */
+} dx_header_t;
+
+typedef struct dx_entry {
+	uint32_t	hash;				/* lowest name hash of the block */
+	uint32_t	block;				/* block of the directory it leads to */
+} dx_entry_t;
+
 /*
  * bitmap operations
  */
@@ -67,6 +197,15 @@ uint8_t get_bitmap(bitmap_t b, int i) {
     return b[i / 8] & (1 << (i & 7)) ? 1 : 0;
 }
 
-int num_of_components(char*, char**);
+/*
+ * a component of a path, as path_next() finds it: a slice of the path itself
+ */
+typedef struct path_comp {
+	const char	*name;				/* start of the component in the path (not NUL-terminated) */
+	size_t		len;				/* length of the component */
+	uint32_t	hash;				/* name hash of the component, as directory lookups use it */
+} path_comp_t;
+
+int path_next(const char **cursor, path_comp_t *comp);
 
 #endif
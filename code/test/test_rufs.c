@@ -0,0 +1,277 @@
+/*
+ * Regression tests for rufs, run against a disk image without mounting it: the FUSE
+ * operations are called directly, and each "mount" (init ... destroy) runs in a child
+ * process of its own, so a remount starts from what is on the disk and nothing else.
+ *
+ * usage: ./test_rufs   (makes and removes test.img in the current directory)
+ */
+#define main rufs_main
+#include "../rufs.c"
+#undef main
+
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+#define TEST_IMAGE "test.img"
+#define TEST_DISK_MB 8          // small, so filling it up is quick
+#define BIG_DIR_FILES 3000      // far more names than one directory block holds
+#define READDIR_PAGE 100        // names the filler takes per readdir call
+
+// outlives the child process a mount runs in
+static struct {
+    int fails;
+    int free_blocks;
+    int ran;
+} *shared;
+
+#define CHECK(c)                                                            \
+    do {                                                                    \
+        if (!(c)) {                                                         \
+            printf("FAIL %s:%d: %s\n", __FILE__, __LINE__, #c);             \
+            __atomic_add_fetch(&shared->fails, 1, __ATOMIC_RELAXED);        \
+        }                                                                   \
+    } while (0)
+
+// the one libfuse provides only works inside its request loop
+static struct fuse_context test_context;
+
+struct fuse_context *fuse_get_context(void) {
+    test_context.uid = getuid();
+    test_context.gid = getgid();
+    return &test_context;
+}
+
+/*
+ * Mount the test image, run body on it and unmount it again, all in a child process.
+ * returns the child's exit status (-1 if it didn't exit)
+ */
+static int mount_and(void (*body)(void)) {
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == 0) {
+        rufs_ope.init(NULL);
+        shared->ran = 1;
+        body();
+        rufs_ope.destroy(NULL);
+        exit(EXIT_SUCCESS);
+    }
+
+    int status;
+    if (pid < 0 || waitpid(pid, &status, 0) != pid || !WIFEXITED(status)) {
+        return -1;
+    }
+    return WEXITSTATUS(status);
+}
+
+static void new_image(void) {
+    unlink(diskfile_path);
+    shared->ran = 0;
+}
+
+static void fill_pattern(char *buf, size_t size, int seed) {
+    for (size_t i = 0; i < size; i++) {
+        buf[i] = 'a' + (seed + i) % 26;
+    }
+}
+
+/*
+ * A directory big enough to be indexed, read back a page at a time
+ */
+static char seen[BIG_DIR_FILES];
+static int page_names;
+static off_t page_last;
+
+static int page_filler(void *buffer, const char *name, const struct stat *st, off_t off) {
+    int i;
+    if (page_names == READDIR_PAGE) {
+        return 1;
+    }
+    page_names++;
+    page_last = off;
+    if (sscanf(name, "f-%d", &i) == 1 && i >= 0 && i < BIG_DIR_FILES) {
+        seen[i]++;
+    }
+    return 0;
+}
+
+static void big_dir_create(void) {
+    struct fuse_file_info fi = {0};
+    char path[64];
+
+    CHECK(rufs_ope.mkdir("/big", 0755) == 0);
+    for (int i = 0; i < BIG_DIR_FILES; i++) {
+        sprintf(path, "/big/f-%d", i);
+        CHECK(rufs_ope.create(path, 0644, &fi) == 0);
+        rufs_ope.release(path, &fi);
+    }
+
+    inode_t dir_inode;
+    CHECK(get_node_by_path("/big", root_inode, &dir_inode) == EXIT_SUCCESS);
+    CHECK(dir_inode.flags & INODE_INDEXED);
+}
+
+static void big_dir_list(void) {
+    struct fuse_file_info fi = {0};
+    off_t offset = 0;
+
+    memset(seen, 0, sizeof(seen));
+    do {
+        page_names = 0;
+        CHECK(rufs_ope.readdir("/big", NULL, page_filler, offset, &fi) == 0);
+        offset = page_last;
+    } while (page_names == READDIR_PAGE);
+
+    int once = 0;
+    for (int i = 0; i < BIG_DIR_FILES; i++) {
+        once += (seen[i] == 1);
+    }
+    CHECK(once == BIG_DIR_FILES);
+}
+
+/*
+ * A file kept in its inode, moved out to a block by a write and truncated back
+ */
+static void inline_grow(void) {
+    struct fuse_file_info fi = {0};
+    struct stat st;
+    char buf[3 * BLOCK_SIZE], rbuf[3 * BLOCK_SIZE];
+    fill_pattern(buf, sizeof(buf), 0);
+    int free_blocks = unreserved_blocks();
+
+    CHECK(rufs_ope.create("/small", 0644, &fi) == 0);
+    CHECK(rufs_ope.write("/small", buf, 50, 0, &fi) == 50);
+    CHECK(rufs_ope.flush("/small", &fi) == 0);
+    CHECK(rufs_ope.getattr("/small", &st) == 0 && st.st_size == 50 && st.st_blocks == 0);
+    CHECK(unreserved_blocks() == free_blocks);
+
+    // outgrowing the inode keeps what was there
+    CHECK(rufs_ope.write("/small", buf + 50, sizeof(buf) - 50, 50, &fi) == (int)sizeof(buf) - 50);
+    CHECK(rufs_ope.flush("/small", &fi) == 0);
+    CHECK(rufs_ope.read("/small", rbuf, sizeof(rbuf), 0, &fi) == (int)sizeof(buf));
+    CHECK(memcmp(rbuf, buf, sizeof(buf)) == 0);
+    CHECK(unreserved_blocks() == free_blocks - 3);
+
+    CHECK(rufs_ope.truncate("/small", 10) == 0);
+    CHECK(unreserved_blocks() == free_blocks - 1);
+    rufs_ope.release("/small", &fi);
+}
+
+static void inline_check(void) {
+    struct fuse_file_info fi = {0};
+    struct stat st;
+    char buf[BLOCK_SIZE], rbuf[BLOCK_SIZE];
+    fill_pattern(buf, sizeof(buf), 0);
+
+    CHECK(rufs_ope.getattr("/small", &st) == 0 && st.st_size == 10);
+    CHECK(rufs_ope.read("/small", rbuf, sizeof(rbuf), 0, &fi) == 10 && memcmp(rbuf, buf, 10) == 0);
+
+    // growing it again reads zeros past the old end, not what the block held before
+    CHECK(rufs_ope.truncate("/small", 100) == 0);
+    CHECK(rufs_ope.read("/small", rbuf, sizeof(rbuf), 0, &fi) == 100);
+    CHECK(memcmp(rbuf, buf, 10) == 0 && rbuf[10] == 0 && rbuf[99] == 0);
+
+    int free_blocks = unreserved_blocks();
+    CHECK(rufs_ope.truncate("/small", 0) == 0);
+    CHECK(unreserved_blocks() == free_blocks + 1);
+}
+
+/*
+ * Filling the disk up, then freeing it again
+ */
+static void full_record(void) {
+    shared->free_blocks = unreserved_blocks();
+}
+
+static void full_fill(void) {
+    struct fuse_file_info fi = {0};
+    char buf[BLOCK_SIZE];
+    fill_pattern(buf, sizeof(buf), 1);
+
+    CHECK(rufs_ope.create("/filler", 0644, &fi) == 0);
+    off_t offset = 0;
+    int ret_stat;
+    while ((ret_stat = rufs_ope.write("/filler", buf, sizeof(buf), offset, &fi)) == (int)sizeof(buf)) {
+        offset += sizeof(buf);
+    }
+    CHECK(ret_stat == -ENOSPC);
+    CHECK(offset > 0);
+    CHECK(rufs_ope.flush("/filler", &fi) == 0);
+    rufs_ope.release("/filler", &fi);
+
+    // a new file still fits in its inode, but a block of data doesn't
+    CHECK(rufs_ope.create("/more", 0644, &fi) == 0);
+    CHECK(rufs_ope.write("/more", buf, sizeof(buf), 0, &fi) == -ENOSPC);
+    rufs_ope.release("/more", &fi);
+
+    CHECK(rufs_ope.unlink("/filler") == 0);
+    CHECK(rufs_ope.unlink("/more") == 0);
+}
+
+static void full_check(void) {
+    struct stat st;
+    CHECK(rufs_ope.getattr("/filler", &st) == -ENOENT);
+    CHECK(unreserved_blocks() == shared->free_blocks);
+}
+
+static void nothing(void) {
+}
+
+/*
+ * Make the test image one of the version before
+ */
+static int downgrade_image(void) {
+    superblock_t sb;
+    int fd = open(diskfile_path, O_RDWR);
+    if (fd < 0) {
+        return EXIT_FAILURE;
+    }
+    int ret_stat = EXIT_FAILURE;
+    if (pread(fd, &sb, sizeof(sb), 0) == sizeof(sb)) {
+        sb.version = RUFS_VERSION - 1;
+        if (pwrite(fd, &sb, sizeof(sb), 0) == sizeof(sb)) {
+            ret_stat = EXIT_SUCCESS;
+        }
+    }
+    close(fd);
+    return ret_stat;
+}
+
+int main(int argc, char *argv[]) {
+    shared = mmap(NULL, sizeof(*shared), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (shared == MAP_FAILED) {
+        perror("mmap");
+        return EXIT_FAILURE;
+    }
+
+    getcwd(diskfile_path, PATH_MAX);
+    strcat(diskfile_path, "/" TEST_IMAGE);
+    config.disk_size = TEST_DISK_MB;
+
+    printf("big directory, paged readdir\n");
+    new_image();
+    CHECK(mount_and(big_dir_create) == 0);
+    CHECK(mount_and(big_dir_list) == 0);
+
+    printf("inline data, promoted and truncated\n");
+    new_image();
+    CHECK(mount_and(inline_grow) == 0);
+    CHECK(mount_and(inline_check) == 0);
+
+    printf("ENOSPC, unlink, remount\n");
+    new_image();
+    CHECK(mount_and(full_record) == 0);
+    CHECK(mount_and(full_fill) == 0);
+    CHECK(mount_and(full_check) == 0);
+
+    printf("wrong version image\n");
+    new_image();
+    CHECK(mount_and(nothing) == 0);
+    CHECK(downgrade_image() == EXIT_SUCCESS);
+    shared->ran = 0;
+    CHECK(mount_and(nothing) == EXIT_FAILURE);
+    CHECK(shared->ran == 0);
+
+    unlink(diskfile_path);
+    printf("%d failures\n", shared->fails);
+    return (shared->fails == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}